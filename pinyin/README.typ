@@ -65,6 +65,8 @@ make main_word_tri && ./main_word_tri run [dataset] < data/input.txt > data/outp
 
 这里 `[dataset]` 可选 `web`（社区问答语料）或 `sina`（下发的新浪新闻数据集）。实际表现中，`web` 数据集的准确率更高。
 
+以上三个程序都支持 `--threads N` 参数，使用 `N` 个线程并行翻译输入，输出顺序与输入保持一致。
+
 #set heading(numbering: "附 1.1")
 #counter(heading).update(0)
 
@@ -123,9 +125,11 @@ make main_word_tri && ./main_word_tri run [dataset] < data/input.txt > data/outp
   make main_word_tri && ./main_word_tri make-dict [dataset]
   ```
 
+  两个命令都支持 `--threads N` 参数，将语料按字节区间切分给 `N` 个线程并行统计，最后按语料顺序合并，生成的词典与单线程完全一致。
+
   当 `[dataset]` 为 `web` 时，需要先下载社区问答语料，见 @data:web。
 
-  生成的词典文件会放在 `extra` 目录下，命名为 `dict_[dataset].bin` 和 `dict_[dataset]_words.txt`。
+  生成的词典文件会放在 `extra` 目录下，命名为 `dict_[dataset].bin` 和 `dict_[dataset]_words.txt`。同时会生成 `dict_[dataset].model`，这是可以直接 `mmap` 使用的二进制模型，`run` 时会优先加载它，省去解析开销，且多个进程可共享同一份页缓存。
 ]
 
 - 二元模型词典（`main_word`）
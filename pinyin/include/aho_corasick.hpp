@@ -1,20 +1,40 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
 #include <map>
 #include <memory>
 #include <queue>
+#include <type_traits>
 #include <vector>
 
 #include "common.hpp"
+#include "csr.hpp"
 
 const u32 INVALID_NODE = -1;
 
 /**
  * Aho-Corasick implementation.
+ *
+ * The automaton is constructed as a tree of `std::map` children. `build` then
+ * freezes the children of every node into a double array (base/check), so
+ * that a transition is an array lookup instead of a map search. Missing
+ * transitions follow fail links as usual, down to the root, whose goto
+ * function is a plain array. Entries must be of an integral type.
+ *
+ * The goto function is deliberately not completed into a single lookup: a
+ * node inherits the children of its fail nodes, so for 100k keys of 2 to 6
+ * entries over a Zipf-like alphabet of 406 the double array grew from 0.28M
+ * to 74M slots, and a transition became 3.5 times slower from cache misses.
+ *
+ * `build` also follows the output (dictionary suffix) links once and lays out
+ * the values matched at every node contiguously, so `values` and
+ * `for_all_values` never visit nodes without a value.
  */
 template <class K, class V> class AhoCorasick {
 public:
   using E = typename K::value_type;
+  static_assert(std::is_integral<E>::value, "Entries must be integral");
 
   DISABLE_COPY(AhoCorasick);
 
@@ -27,6 +47,25 @@ public:
    * Transits a state with an entry.
    */
   u32 transit(u32 node, const E &e) const {
+    if (!frozen)
+      return transit_tree(node, e);
+    size_t c = code(e);
+    if (c >= root_goto.size())
+      return 0;
+    for (; node != 0; node = fails[node]) {
+      size_t slot = (size_t)base[node] + c;
+      if (slot < check.size() && check[slot] == node)
+        return next[slot];
+    }
+    return root_goto[c];
+  }
+
+  /**
+   * Transits a state with an entry by walking the tree and its fail links.
+   *
+   * This is what `transit` does before `build`.
+   */
+  u32 transit_tree(u32 node, const E &e) const {
     while (node != INVALID_NODE) {
       auto it = nodes[node].children.find(e);
       if (it != nodes[node].children.end())
@@ -52,6 +91,7 @@ public:
    * Inserts a key-value pair into the automaton.
    */
   std::unique_ptr<V> &insert(const K &key) {
+    frozen = false;
     u32 node = 0;
     for (auto &e : key) {
       auto it = nodes[node].children.find(e);
@@ -75,40 +115,205 @@ public:
    * Should be called after all insertions.
    */
   void build() {
+    frozen = false;
+    std::vector<u32> order;
     std::queue<u32> q;
     q.push(0);
     while (!q.empty()) {
       auto node = q.front();
       q.pop();
+      order.push_back(node);
       for (auto &p : nodes[node].children) {
         auto child = p.second;
         nodes[child].fail = transit(nodes[node].fail, p.first);
         q.push(child);
       }
     }
+    freeze(order);
+    collect_values(order);
   }
 
+  size_t size() const { return nodes.size(); }
+
+  /// Number of slots of the frozen double array.
+  size_t table_size() const { return check.size(); }
+
   /**
    * Gets the value associated with a node.
    */
   const std::unique_ptr<V> &get(u32 node) const { return nodes[node].value; }
   std::unique_ptr<V> &get(u32 node) { return nodes[node].value; }
 
+  /**
+   * Gets all values associated with a node and its fail ancestors, deepest
+   * first.
+   *
+   * Only valid after `build`.
+   */
+  Span<const V *> values(u32 node) const {
+    assert(frozen && "Call build() before looking up values");
+    return Span<const V *>(matches.data() + match_begin[node],
+                           match_end[node] - match_begin[node]);
+  }
+
   /**
    * For all values associated with a node, invoke the given function.
    *
    * This looks up all values associated with a node and its ancestors.
    */
   template <class F> void for_all_values(u32 node, F &&f) const {
-    while (node != INVALID_NODE) {
+    for (auto value : values(node)) {
+      f(*value);
+    }
+  }
+
+private:
+  static size_t code(const E &e) {
+    return (typename std::make_unsigned<E>::type)e;
+  }
+
+  /**
+   * Packs the children of every node into the double array.
+   *
+   * Node `n` with children codes `c` gets a base `b` such that all slots
+   * `b + c` are free, found by walking a list of the free slots, as in a
+   * classic double-array trie. The root's children go to `root_goto`
+   * instead, since the root has the most of them.
+   *
+   * A free slot that fails to host a first child `MAX_MISSES` times is
+   * dropped from the list (it may still be taken by a later child), so the
+   * walk does not keep rescanning the crowded start of the array.
+   */
+  void freeze(const std::vector<u32> &order) {
+    size_t alphabet = 0;
+    for (auto &node : nodes) {
+      if (!node.children.empty())
+        alphabet = std::max(alphabet, code(node.children.rbegin()->first) + 1);
+    }
+    root_goto.assign(alphabet, 0);
+    for (auto &p : nodes[0].children) {
+      root_goto[code(p.first)] = p.second;
+    }
+    fails.resize(nodes.size());
+    for (u32 node = 0; node < nodes.size(); node++) {
+      fails[node] = nodes[node].fail == INVALID_NODE ? 0 : nodes[node].fail;
+    }
+
+    // Free slots form a doubly linked list, with `FREE_END` as its head.
+    // Slot `s` of the list is entry `s + 1` of `free_prev` / `free_next`.
+    const size_t FREE_END = 0;
+    std::vector<size_t> free_prev(1, FREE_END), free_next(1, FREE_END);
+    base.assign(nodes.size(), 0);
+    check.clear();
+    next.clear();
+    // Misses of each slot; `MAX_MISSES` once it has left the list
+    const u8 MAX_MISSES = 16;
+    std::vector<u8> misses;
+    auto grow = [&](size_t size) {
+      while (check.size() < size) {
+        size_t entry = check.size() + 1, last = free_prev[FREE_END];
+        check.push_back(INVALID_NODE);
+        next.push_back(0);
+        misses.push_back(0);
+        free_prev.push_back(last);
+        free_next.push_back(FREE_END);
+        free_next[last] = entry;
+        free_prev[FREE_END] = entry;
+      }
+    };
+    auto unlink = [&](size_t slot) {
+      size_t entry = slot + 1;
+      free_next[free_prev[entry]] = free_next[entry];
+      free_prev[free_next[entry]] = free_prev[entry];
+      misses[slot] = MAX_MISSES;
+    };
+    auto take = [&](size_t slot) {
+      if (misses[slot] != MAX_MISSES)
+        unlink(slot);
+    };
+    auto miss = [&](size_t slot) {
+      if (++misses[slot] == MAX_MISSES) {
+        misses[slot]--;
+        unlink(slot);
+      }
+    };
+
+    std::vector<bool> used_base;
+    for (auto node : order) {
+      auto &children = nodes[node].children;
+      if (node == 0 || children.empty())
+        continue;
+      size_t lo = code(children.begin()->first);
+      size_t hi = code(children.rbegin()->first);
+      // Try to put the first child in every free slot, then past the end
+      size_t b = 0;
+      for (size_t entry = free_next[FREE_END], after;; entry = after) {
+        after = free_next[entry];
+        if (entry == FREE_END) {
+          b = std::max(check.size(), lo) - lo;
+          while (b < used_base.size() && used_base[b])
+            b++;
+          grow(b + hi + 1);
+          break;
+        }
+        if (entry - 1 < lo)
+          continue;
+        b = entry - 1 - lo;
+        bool ok = b >= used_base.size() || !used_base[b];
+        if (ok) {
+          grow(b + hi + 1);
+          for (auto it = children.begin(); ok && it != children.end(); ++it) {
+            ok = check[b + code(it->first)] == INVALID_NODE;
+          }
+        }
+        if (ok)
+          break;
+        miss(entry - 1);
+      }
+
+      base[node] = b;
+      if (b >= used_base.size())
+        used_base.resize(b + 1);
+      used_base[b] = true;
+      for (auto &p : children) {
+        size_t slot = b + code(p.first);
+        check[slot] = node;
+        next[slot] = p.second;
+        take(slot);
+      }
+    }
+    frozen = true;
+  }
+
+  /**
+   * Lays out the values matched at every node.
+   *
+   * A node with a value gets its own span, made of the value followed by the
+   * span of its output link. A node without one shares the span of its fail
+   * node, which is exactly the span of its output link.
+   */
+  void collect_values(const std::vector<u32> &order) {
+    matches.clear();
+    match_begin.assign(nodes.size(), 0);
+    match_end.assign(nodes.size(), 0);
+    for (auto node : order) {
+      u32 fail = nodes[node].fail;
+      u32 begin = fail == INVALID_NODE ? 0 : match_begin[fail];
+      u32 end = fail == INVALID_NODE ? 0 : match_end[fail];
       if (nodes[node].value) {
-        f(nodes[node].value);
+        match_begin[node] = matches.size();
+        matches.push_back(nodes[node].value.get());
+        for (u32 i = begin; i < end; i++) {
+          matches.push_back(matches[i]);
+        }
+        match_end[node] = matches.size();
+      } else {
+        match_begin[node] = begin;
+        match_end[node] = end;
       }
-      node = nodes[node].fail;
     }
   }
 
-private:
   struct Node {
     std::map<E, u32> children;
     std::unique_ptr<V> value;
@@ -118,4 +323,9 @@ private:
   };
 
   std::vector<Node> nodes;
+
+  bool frozen = false;
+  std::vector<u32> base, check, next, root_goto, fails;
+  std::vector<const V *> matches;
+  std::vector<u32> match_begin, match_end;
 };
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+
+#include "common.hpp"
+#include "csr.hpp"
+
+/**
+ * Index of candidate words by syllable sequence (pinyin).
+ *
+ * Words sharing a pinyin form a group, stored as a contiguous range of word
+ * indices sorted by descending unigram frequency, so the least frequent
+ * candidates of a group can be cut off by truncating its range.
+ *
+ * Groups are bucketed by (first syllable, length). A bucket is a range of
+ * groups sorted by their remaining syllables, which are binary searched on
+ * lookup; most buckets only hold a few groups.
+ *
+ * Every group also has its words sorted by index, with their rank in the
+ * group, so they can be merged with other sorted word lists (e.g. bigram
+ * successors).
+ */
+class CandidateIndex {
+public:
+  DISABLE_COPY(CandidateIndex);
+
+  CandidateIndex() = default;
+
+  /**
+   * Adds a word with its pinyin and unigram frequency.
+   *
+   * `build` must be called after all additions.
+   */
+  void add(Span<Syllable> pinyin, Word word, u64 freq);
+
+  /**
+   * Builds the index from the added words.
+   */
+  void build();
+
+  /**
+   * Gets the words of `pinyin`, most frequent first (ties by index).
+   *
+   * Returns an empty span if no word has this pinyin.
+   */
+  Span<Word> find(Span<Syllable> pinyin) const {
+    size_t g = find_group(pinyin);
+    return g == NO_GROUP ? Span<Word>() : group(g);
+  }
+  /**
+   * Gets the group of `pinyin`, or `NO_GROUP` if no word has this pinyin.
+   */
+  size_t find_group(Span<Syllable> pinyin) const;
+
+  static const size_t NO_GROUP = -1;
+
+  /// Length of the longest pinyin.
+  size_t max_length() const { return max_len; }
+
+  /// Number of groups, i.e. distinct pinyins.
+  size_t groups() const { return group_offsets.size() - 1; }
+  /// Words of a group, most frequent first.
+  Span<Word> group(size_t g) const {
+    return Span<Word>(words.data() + group_offsets[g],
+                      group_offsets[g + 1] - group_offsets[g]);
+  }
+  /// Position of the first word of a group among the words of all groups.
+  size_t group_begin(size_t g) const { return group_offsets[g]; }
+  /// Words of a group sorted by index.
+  Span<Word> sorted_group(size_t g) const {
+    return Span<Word>(sorted_words.data() + group_offsets[g],
+                      group_offsets[g + 1] - group_offsets[g]);
+  }
+  /// Ranks in the group of `sorted_group(g)`.
+  Span<u32> sorted_ranks(size_t g) const {
+    return Span<u32>(ranks.data() + group_offsets[g],
+                     group_offsets[g + 1] - group_offsets[g]);
+  }
+  /// Total unigram frequency of a group.
+  u64 group_freq(size_t g) const { return freqs[g]; }
+
+private:
+  /// Word added before `build`.
+  struct Entry {
+    /// Pinyin is `pending_syllables[offset, offset + length)`.
+    u32 offset;
+    u32 length;
+    Word word;
+    u64 freq;
+  };
+
+  std::vector<Entry> entries;
+  std::vector<Syllable> pending_syllables;
+
+  size_t max_len = 0;
+  /// One more than the largest first syllable.
+  size_t syllable_bound = 0;
+  /// Bucket `b = first * max_len + length - 1` holds groups
+  /// `[bucket_offsets[b], bucket_offsets[b + 1])`.
+  std::vector<u32> bucket_offsets;
+  /// Syllables after the first of group `g` start at `rests[rest_offsets[g]]`.
+  std::vector<u32> rest_offsets;
+  std::vector<Syllable> rests;
+  /// Group `g` is `words[group_offsets[g], group_offsets[g + 1])`.
+  std::vector<u32> group_offsets = {0};
+  std::vector<Word> words;
+  /// Words of each group sorted by index, and their ranks, in the same ranges.
+  std::vector<Word> sorted_words;
+  std::vector<u32> ranks;
+  std::vector<u64> freqs;
+};
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+#include "common.hpp"
+
+/**
+ * Codebook quantizing values to small integer codes.
+ *
+ * The sorted distinct values of a sample are split into at most `entries`
+ * bins, each decoding to the mean of its bin. A sample with few enough
+ * distinct values is represented exactly.
+ *
+ * `build` makes bins of roughly equal weight, which suits values of similar
+ * magnitude (e.g. log-probabilities). `build_log` makes bins of equal width
+ * in log space, which suits positive values spanning orders of magnitude
+ * (e.g. counts): equal weight would lump the rare large values together.
+ */
+template <class T> class Codebook {
+public:
+  Codebook() = default;
+  Codebook(std::vector<T> sample, size_t entries) {
+    build(std::move(sample), entries);
+  }
+
+  void build(std::vector<T> sample, size_t entries) {
+    auto distinct = histogram(std::move(sample), entries);
+    if (distinct.size() <= entries)
+      return;
+
+    u64 remaining = 0;
+    for (auto &p : distinct) {
+      remaining += p.second;
+    }
+    u64 weight = 0;
+    double sum = 0;
+    for (size_t i = 0; i < distinct.size(); i++) {
+      weight += distinct[i].second;
+      sum += (double)distinct[i].first * distinct[i].second;
+      size_t left = distinct.size() - i - 1, open = entries - book.size();
+      if (open > 1 && (weight * open >= remaining || left < open)) {
+        book.push_back(mean(sum, weight));
+        remaining -= weight;
+        weight = 0;
+        sum = 0;
+      }
+    }
+    if (weight)
+      book.push_back(mean(sum, weight));
+  }
+
+  /**
+   * Builds bins of equal width in log space, each decoding to the weighted
+   * geometric mean of its bin, so the relative error is bounded for every
+   * value. All values must be positive.
+   */
+  void build_log(std::vector<T> sample, size_t entries) {
+    auto distinct = histogram(std::move(sample), entries);
+    log_scale = true;
+    if (distinct.size() <= entries)
+      return;
+    assert(distinct.front().first > 0 && "Non-positive value");
+
+    std::vector<double> logs;
+    for (auto &p : distinct) {
+      logs.push_back(std::log((double)p.first));
+    }
+    // Bins are filled greedily, so fewer of them are needed for wider ones:
+    // binary search the narrowest width that fits in `entries`
+    auto bins = [&](double width) {
+      size_t count = 0;
+      for (size_t i = 0; i < logs.size();) {
+        double limit = logs[i] + width;
+        while (i < logs.size() && logs[i] <= limit)
+          i++;
+        count++;
+      }
+      return count;
+    };
+    double lo = 0, hi = logs.back() - logs.front();
+    for (int step = 0; step < 64; step++) {
+      double mid = (lo + hi) / 2;
+      if (bins(mid) <= entries) {
+        hi = mid;
+      } else {
+        lo = mid;
+      }
+    }
+
+    for (size_t i = 0; i < logs.size();) {
+      double limit = logs[i] + hi, sum = 0;
+      u64 weight = 0;
+      for (; i < logs.size() && logs[i] <= limit; i++) {
+        sum += logs[i] * distinct[i].second;
+        weight += distinct[i].second;
+      }
+      book.push_back(mean_log(sum, weight));
+    }
+    // Rounding may merge neighbouring entries of an integral type
+    book.erase(std::unique(book.begin(), book.end()), book.end());
+  }
+
+  /**
+   * Gets the code of the entry nearest to `value`, by ratio for a codebook
+   * built with `build_log`.
+   */
+  u32 encode(T value) const {
+    auto it = std::lower_bound(book.begin(), book.end(), value);
+    if (it == book.end())
+      return book.size() - 1;
+    if (it != book.begin()) {
+      bool lower = log_scale
+                       ? (double)value * value < (double)*(it - 1) * *it
+                       : value - *(it - 1) < *it - value;
+      if (lower)
+        --it;
+    }
+    return it - book.begin();
+  }
+
+  T operator[](u32 code) const { return book[code]; }
+
+  const std::vector<T> &entries() const { return book; }
+  size_t size() const { return book.size(); }
+
+private:
+  /**
+   * Counts the occurrences of the distinct values of `sample`, in order.
+   *
+   * If there are at most `entries` of them, they become the codebook.
+   */
+  std::vector<std::pair<T, u64>> histogram(std::vector<T> sample,
+                                           size_t entries) {
+    assert(entries > 0 && "Empty codebook");
+    std::sort(sample.begin(), sample.end());
+    std::vector<std::pair<T, u64>> distinct;
+    for (auto value : sample) {
+      if (distinct.empty() || distinct.back().first != value) {
+        distinct.emplace_back(value, 1);
+      } else {
+        distinct.back().second++;
+      }
+    }
+
+    book.clear();
+    log_scale = false;
+    if (distinct.size() <= entries) {
+      for (auto &p : distinct) {
+        book.push_back(p.first);
+      }
+    }
+    return distinct;
+  }
+
+  static T mean(double sum, u64 weight) {
+    return std::is_integral<T>::value ? (T)std::llround(sum / weight)
+                                      : (T)(sum / weight);
+  }
+  static T mean_log(double sum, u64 weight) {
+    double value = std::exp(sum / weight);
+    return std::is_integral<T>::value ? (T)std::llround(value) : (T)value;
+  }
+
+  std::vector<T> book;
+  bool log_scale = false;
+};
+
+/**
+ * Per-entry scores, stored either as floats or as codes into a codebook.
+ */
+class ScoreTable {
+public:
+  /**
+   * Replaces the scores, quantizing them to `bits` bits (8 or 16) unless
+   * `bits` is 32.
+   */
+  void assign(std::vector<float> scores, u32 bits) {
+    assert((bits == 8 || bits == 16 || bits == 32) && "Unsupported bits");
+    this->bits = bits;
+    std::vector<u8>().swap(codes8);
+    std::vector<u16>().swap(codes16);
+    if (bits == 32) {
+      floats = std::move(scores);
+      codebook = Codebook<float>();
+      return;
+    }
+
+    // The last code is reserved for non-finite scores (impossible edges)
+    std::vector<float> finite;
+    for (auto score : scores) {
+      if (std::isfinite(score))
+        finite.push_back(score);
+    }
+    codebook.build(std::move(finite), ((size_t)1 << bits) - 1);
+    for (auto score : scores) {
+      u32 code = (1 << bits) - 1;
+      if (std::isfinite(score))
+        code = codebook.encode(score);
+      if (bits == 8) {
+        codes8.push_back(code);
+      } else {
+        codes16.push_back(code);
+      }
+    }
+    std::vector<float>().swap(floats);
+  }
+
+  float operator[](u64 index) const {
+    switch (bits) {
+    case 8:
+      return code_score(codes8[index]);
+    case 16:
+      return code_score(codes16[index]);
+    default:
+      return floats[index];
+    }
+  }
+
+  /// Decodes the `n` scores from `first` to `out`.
+  void decode(u64 first, size_t n, float *out) const {
+    if (bits == 32) {
+      std::copy_n(floats.begin() + first, n, out);
+      return;
+    }
+    for (size_t i = 0; i < n; i++) {
+      out[i] = (*this)[first + i];
+    }
+  }
+
+  /// Bytes used by the table.
+  size_t memory() const {
+    return floats.size() * sizeof(float) + codes16.size() * sizeof(u16) +
+           codes8.size() + codebook.size() * sizeof(float);
+  }
+
+private:
+  float code_score(u32 code) const {
+    return code < codebook.size() ? codebook[code] : -INFINITY;
+  }
+
+  u32 bits = 32;
+  std::vector<float> floats;
+  std::vector<u16> codes16;
+  std::vector<u8> codes8;
+  Codebook<float> codebook;
+};
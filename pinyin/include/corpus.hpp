@@ -1,25 +1,38 @@
 #pragma once
 
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <fstream>
 #include <string>
 #include <vector>
 
+#include "csr.hpp"
 #include "encoding.hpp"
+#include "json.hpp"
 #include "tables.hpp"
 #include "utils.hpp"
 
 void init_tables(SyllableTable &sy_table, CharTable &ch_table);
 
 /**
- * Extracts a slice from a string, using start & end pattern.
+ * Loads a word list written by `make-dict` (`extra/dict_*words_*.txt`).
  *
- * Equivalent to `s.split(start, 1)[1].split(end, 1)[0]` in Python.
+ * Each line is a word optionally followed by its pinyin. <s> and </s> are
+ * skipped since `WordTable` has them built in.
+ */
+void load_words(const SyllableTable &sy_table, WordTable &word_table,
+                const char *path);
 
+/**
+ * Loads the words of a dictionary written by `make-dict`, from the binary
+ * image `<prefix>.table` if present, or else from the word list
+ * `<prefix>.txt`.
+ *
+ * Returns `false` if neither exists.
  */
-std::pair<size_t, size_t> extract_slice(const std::string &str,
-                                        const char *start, const char *end,
-                                        size_t start_idx = 0);
+bool load_dict_words(const SyllableTable &sy_table, WordTable &word_table,
+                     const std::string &prefix);
 
 /// Options for corpus reading.
 struct CorpusOptions {
@@ -40,6 +53,15 @@ struct CorpusOptions {
    * If not, the corpus will be decoded from GBK before processing.
    */
   bool utf8 = true;
+
+  /**
+   * Whether to pass strings in the encoding of the corpus instead of UTF-8,
+   * i.e. not to decode a GBK corpus.
+   *
+   * Escapes are still decoded, `\uXXXX` ones into the corpus encoding;
+   * characters missing from GBK are dropped.
+   */
+  bool raw = false;
 };
 
 /**
@@ -49,48 +71,203 @@ struct CorpusOptions {
  */
 void get_dataset_options(const std::string &dataset, CorpusOptions &options);
 
+/// Statistics of a corpus read.
+struct CorpusStats {
+  u64 bytes = 0;
+  u64 lines = 0;
+  /// Lines skipped because they are not JSON objects.
+  u64 malformed = 0;
+
+  CorpusStats &operator+=(const CorpusStats &other) {
+    bytes += other.bytes;
+    lines += other.lines;
+    malformed += other.malformed;
+    return *this;
+  }
+};
+
 /**
- * Read corpus.
- *
- * Corpus files should be in JSONL format. For each JSON object, strings
- * specified in options.keys will be extracted and passed to f.
- *
- * NOTE: Due to the laziness of the author, keys CANNOT be the last element of a
- *       JSON object, and the structure should be properly spaced. Specifically,
- *       your JSON line is expected to be of the form
+ * Scratch space of `read_corpus_line`, reused across lines.
+ */
+struct CorpusLineBuffers {
+  /// Decoded value of each field, when it is not a slice of the line.
+  std::vector<std::string> decoded;
+  /// Value of each field of the current line.
+  std::vector<Span<char>> values;
+};
+
+/**
+ * Extracts the strings of the corpus line starting at `begin`, and returns the
+ * start of the next line. See `read_corpus`.
  *
- *         {"key1": "value1", "key2": "value2", ...}
+ * All fields are decoded before `f` is called, so a line with an invalid
+ * field yields no strings at all.
  */
-template <class F> void read_corpus(const CorpusOptions &options, F &&f) {
-  std::vector<std::string> patterns;
-  patterns.reserve(options.keys.size());
-  for (auto *key : options.keys) {
-    patterns.push_back(std::string("\"") + key + "\": \"");
+template <class F>
+const char *read_corpus_line(const CorpusOptions &options,
+                             JsonFieldExtractor &extractor, const char *begin,
+                             const char *end, CorpusLineBuffers &buffers,
+                             CorpusStats &stats, F &&f) {
+  const char *next;
+  auto status = extractor.parse_line(begin, end, next);
+  if (status == JsonFieldExtractor::LineStatus::EMPTY)
+    return next;
+  stats.lines++;
+  if (status == JsonFieldExtractor::LineStatus::MALFORMED) {
+    stats.malformed++;
+    return next;
+  }
+  const bool transcode = !options.utf8 && !options.raw;
+  buffers.decoded.resize(extractor.size());
+  buffers.values.resize(extractor.size());
+  for (size_t i = 0; i < extractor.size(); i++) {
+    if (!extractor.found(i))
+      continue;
+    auto raw = extractor.raw_value(i);
+    if (!extractor.escaped(i) && !transcode) {
+      buffers.values[i] = raw;
+      continue;
+    }
+    auto &buffer = buffers.decoded[i];
+    buffer.clear();
+    if (!extractor.escaped(i)) {
+      gbk_to_utf8(raw.data(), raw.size(), buffer);
+    } else {
+      auto append_raw = [&](const char *data, size_t size) {
+        if (transcode) {
+          gbk_to_utf8(data, size, buffer);
+        } else {
+          buffer.append(data, size);
+        }
+      };
+      auto append_codepoint = [&](u32 codepoint) {
+        if (options.utf8 || !options.raw) {
+          append_utf8(buffer, codepoint);
+        } else {
+          std::string utf8;
+          append_utf8(utf8, codepoint);
+          utf8_to_gbk(utf8.data(), utf8.size(), buffer);
+        }
+      };
+      if (!decode_json_string(raw, !options.utf8, buffer, append_raw,
+                              append_codepoint)) {
+        stats.malformed++;
+        return next;
+      }
+    }
+    buffers.values[i] = Span<char>(buffer.data(), buffer.size());
   }
+  for (size_t i = 0; i < extractor.size(); i++) {
+    if (extractor.found(i))
+      f(buffers.values[i]);
+  }
+  return next;
+}
+
+/**
+ * Prints the statistics and ingestion throughput of a corpus read.
+ */
+void report_corpus_stats(const CorpusStats &stats, double seconds);
 
-  iconv_t ic = iconv_open("UTF-8", "GBK");
+/**
+ * Read corpus.
+ *
+ * Corpus files should be in JSONL format. For each JSON object, the string
+ * values of `options.keys` are decoded and passed to f as a `Span<char>`,
+ * valid during the call only, in the order of `options.keys`. Unescaped
+ * strings that need no transcoding are slices of the memory-mapped file;
+ * other strings are decoded into reused buffers. Missing keys are skipped,
+ * and so are lines that are not JSON objects, which are counted in the
+ * returned statistics.
+ */
+template <class F>
+CorpusStats read_corpus(const CorpusOptions &options, F &&f) {
+  JsonFieldExtractor extractor(options.keys, !options.utf8);
+  CorpusLineBuffers buffers;
+  CorpusStats stats;
+  auto start = std::chrono::steady_clock::now();
 
   for (auto *corpus : options.corpus_list) {
     std::string path(options.corpus_dir);
     path += corpus;
+    MappedFile file(path.data());
+    file.advise_sequential();
+    auto data = (const char *)file.data(), end = data + file.size();
     int count = 0;
-    read_lines(path.data(), [&](std::string &line) {
-      for (auto &pat : patterns) {
-        auto text = extract_slice(line, pat.data(), "\", ");
-        const char *start = line.data() + text.first;
-        const size_t length = text.second - text.first;
-        if (options.utf8) {
-          f(std::string(start, start + length));
-        } else {
-          f(gbk_to_utf8(ic, start, length));
-        }
-      }
+    while (data < end) {
+      data = read_corpus_line(options, extractor, data, end, buffers, stats, f);
       if (options.progress) {
         if (++count % 1000 == 0)
           std::cerr << "Processing " << count << '\n';
       }
-    });
+    }
+    stats.bytes += file.size();
+  }
+
+  if (options.progress) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    report_corpus_stats(stats, elapsed.count());
+  }
+  return stats;
+}
+
+/**
+ * A contiguous byte range of a corpus file.
+ *
+ * A shard owns every line that starts within `[begin, end)`.
+ */
+struct CorpusShard {
+  std::string path;
+  u64 begin, end;
+};
+
+/**
+ * Splits the corpus into about `count` shards of similar size.
+ *
+ * Shards are returned in corpus order, i.e. concatenating the lines of all
+ * shards gives exactly the lines seen by `read_corpus`.
+ */
+std::vector<CorpusShard> split_corpus(const CorpusOptions &options,
+                                      size_t count);
+
+/**
+ * Read a single corpus shard. See `read_corpus`.
+ *
+ * Unlike `read_corpus`, this is safe to call from multiple threads.
+ */
+template <class F>
+CorpusStats read_corpus_shard(const CorpusOptions &options,
+                              const CorpusShard &shard, F &&f) {
+  JsonFieldExtractor extractor(options.keys, !options.utf8);
+
+  MappedFile file(shard.path.data());
+  file.advise_sequential();
+  auto data = (const char *)file.data();
+  const char *end = data + file.size();
+  const char *begin = data + std::min<u64>(shard.begin, file.size());
+  if (shard.begin) {
+    // Skip the line straddling `begin`, it belongs to the previous shard
+    auto newline = (const char *)memchr(begin - 1, '\n', end - begin + 1);
+    begin = newline ? newline + 1 : end;
+  }
+  // The last line starts before `end`, but may extend past it
+  const char *last = data + std::min<u64>(shard.end, file.size());
+  if (last > begin) {
+    auto newline = (const char *)memchr(last - 1, '\n', end - last + 1);
+    last = newline ? newline + 1 : end;
+  } else {
+    last = begin;
+  }
+
+  CorpusLineBuffers buffers;
+  CorpusStats stats;
+  stats.bytes = last - begin;
+
+  while (begin < last) {
+    begin =
+        read_corpus_line(options, extractor, begin, last, buffers, stats, f);
   }
 
-  iconv_close(ic);
+  return stats;
 }
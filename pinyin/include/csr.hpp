@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include "common.hpp"
+
+/**
+ * Non-owning view over a contiguous array.
+ */
+template <class T> class Span {
+public:
+  Span() : ptr(nullptr), len(0) {}
+  Span(const T *ptr, size_t len) : ptr(ptr), len(len) {}
+  Span(const std::vector<T> &vec) : ptr(vec.data()), len(vec.size()) {}
+
+  const T *begin() const { return ptr; }
+  const T *end() const { return ptr + len; }
+  const T *data() const { return ptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+
+  const T &operator[](size_t index) const { return ptr[index]; }
+
+  Span sub(size_t start, size_t count) const {
+    return Span(ptr + start, count);
+  }
+
+private:
+  const T *ptr;
+  size_t len;
+};
+
+/// Writes a span of bytes, e.g. a word of `WordTable`.
+inline std::ostream &operator<<(std::ostream &out, Span<char> text) {
+  return out.write(text.data(), text.size());
+}
+
+const u64 INVALID_INDEX = -1;
+
+/**
+ * Compressed sparse row (CSR) view, mapping (row, key) pairs to values.
+ *
+ * Row `r` owns entries `[offsets[r], offsets[r + 1])` of `keys` and
+ * `values`. Keys within a row must be sorted ascendingly. Offsets are any
+ * indexable array of integers, e.g. narrowed ones.
+ */
+template <class K, class V, class Offsets = Span<u64>> struct CsrView {
+  Offsets offsets;
+  Span<K> keys;
+  Span<V> values;
+
+  size_t rows() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+  Span<K> row_keys(size_t row) const {
+    return keys.sub(offsets[row], offsets[row + 1] - offsets[row]);
+  }
+  Span<V> row_values(size_t row) const {
+    return values.sub(offsets[row], offsets[row + 1] - offsets[row]);
+  }
+
+  /**
+   * Finds the global entry index of `key` in `row`.
+   *
+   * Returns `INVALID_INDEX` if not found.
+   */
+  u64 find(size_t row, const K &key) const {
+    const K *first = keys.data() + offsets[row];
+    const K *last = keys.data() + offsets[row + 1];
+    const K *it = std::lower_bound(first, last, key);
+    if (it == last || *it != key)
+      return INVALID_INDEX;
+    return it - keys.data();
+  }
+
+  /**
+   * Gets the value of (row, key), or `V()` if absent.
+   */
+  V get(size_t row, const K &key) const {
+    auto index = find(row, key);
+    return index == INVALID_INDEX ? V() : values[index];
+  }
+};
+
+/**
+ * Finds the first element of `[first, last)` not less than `value`, searching
+ * exponentially from `first` and then binary.
+ *
+ * This takes O(log d) for an answer d elements away, so merging a short
+ * sorted list into a long one costs little more than the short one's length.
+ */
+template <class T>
+const T *gallop(const T *first, const T *last, const T &value) {
+  size_t step = 1;
+  while (step < (size_t)(last - first) && first[step] < value)
+    step *= 2;
+  return std::lower_bound(first + step / 2,
+                          first + std::min(step, (size_t)(last - first)),
+                          value);
+}
@@ -1,24 +1,69 @@
 #pragma once
 
-#include <iconv.h>
 #include <string>
 
 #include "tables.hpp"
 
-std::string iconv_convert(iconv_t ic, const char *start, size_t len,
-                          size_t outlen);
+/// Returned by `next_utf8` for malformed sequences.
+const u32 INVALID_CODEPOINT = -1;
 
-inline std::string gbk_to_utf8(iconv_t ic, const char *start, size_t len) {
-  return iconv_convert(ic, start, len, len * 2);
+/**
+ * Decodes the UTF-8 character at `p` and advances `p` past it.
+ *
+ * Returns `INVALID_CODEPOINT` on a malformed or truncated sequence, in which
+ * case `p` is advanced by one byte.
+ */
+inline u32 next_utf8(const char *&p, const char *end) {
+  u8 c = *p++;
+  if (c < 0x80)
+    return c;
+  size_t size = c >= 0xf8 ? 0 : c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0;
+  if (!size || (size_t)(end - p) < size)
+    return INVALID_CODEPOINT;
+  u32 codepoint = c & (0x3f >> size);
+  for (size_t i = 0; i < size; i++) {
+    if ((p[i] & 0xc0) != 0x80)
+      return INVALID_CODEPOINT;
+    codepoint = codepoint << 6 | (p[i] & 0x3f);
+  }
+  p += size;
+  return codepoint;
 }
 
-inline std::string utf8_to_gbk(iconv_t ic, const char *start, size_t len) {
-  return iconv_convert(ic, start, len, len);
+/**
+ * Appends the UTF-8 encoding of a code point.
+ */
+void append_utf8(std::string &out, u32 codepoint);
+
+/**
+ * Transcodes GBK to UTF-8, appending the result to `out`.
+ *
+ * Double-byte characters are looked up in a table built once from iconv, and
+ * runs of ASCII are copied 16 bytes at a time. Like iconv, conversion stops at
+ * the first invalid or truncated sequence.
+ */
+void gbk_to_utf8(const char *start, size_t len, std::string &out);
+
+inline std::string gbk_to_utf8(const char *start, size_t len) {
+  std::string result;
+  gbk_to_utf8(start, len, result);
+  return result;
 }
 
 /**
- * Check if a string is in Chinese.
+ * Transcodes UTF-8 to GBK, appending the result to `out`.
  *
- * `ic` should be an iconv from UTF-8 to GBK.
+ * Conversion stops at the first invalid sequence or character not in GBK.
+ */
+void utf8_to_gbk(const char *start, size_t len, std::string &out);
+
+inline std::string utf8_to_gbk(const char *start, size_t len) {
+  std::string result;
+  utf8_to_gbk(start, len, result);
+  return result;
+}
+
+/**
+ * Check if a string is in Chinese, i.e. made only of characters in `ch_table`.
  */
-bool is_chinese(iconv_t ic, const CharTable &ch_table, const std::string &str);
+bool is_chinese(const CharTable &ch_table, const std::string &str);
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+
+/**
+ * Open-addressing hash table with packed u64 keys and linear probing.
+ *
+ * Entries live in flat arrays, so nothing is allocated per entry, and `clear`
+ * keeps the storage for the next use. `EMPTY_KEY` cannot be inserted.
+ */
+template <class V> class HashTable {
+public:
+  static const u64 EMPTY_KEY = -1;
+
+  HashTable() : keys(16, EMPTY_KEY), values(16), count(0) {}
+
+  /**
+   * Removes all entries, keeping the allocated storage.
+   */
+  void clear() {
+    if (count) {
+      std::fill(keys.begin(), keys.end(), EMPTY_KEY);
+      count = 0;
+    }
+  }
+
+  size_t size() const { return count; }
+
+  /**
+   * Gets the value of `key`, or `nullptr` if absent.
+   */
+  const V *find(u64 key) const {
+    size_t mask = keys.size() - 1;
+    for (size_t i = hash(key) & mask;; i = (i + 1) & mask) {
+      if (keys[i] == key)
+        return &values[i];
+      if (keys[i] == EMPTY_KEY)
+        return nullptr;
+    }
+  }
+  V *find(u64 key) {
+    return const_cast<V *>(static_cast<const HashTable *>(this)->find(key));
+  }
+
+  /**
+   * Inserts `value` for `key` unless present.
+   *
+   * Returns the value stored for `key`, valid until the next insertion, and
+   * whether it was inserted.
+   */
+  std::pair<V *, bool> insert(u64 key, const V &value) {
+    assert(key != EMPTY_KEY && "Cannot insert the empty key");
+    if ((count + 1) * 2 > keys.size())
+      grow();
+    size_t mask = keys.size() - 1;
+    for (size_t i = hash(key) & mask;; i = (i + 1) & mask) {
+      if (keys[i] == key)
+        return {&values[i], false};
+      if (keys[i] == EMPTY_KEY) {
+        keys[i] = key;
+        values[i] = value;
+        count++;
+        return {&values[i], true};
+      }
+    }
+  }
+
+private:
+  /// Finalizer of MurmurHash3, spreading both halves of packed keys.
+  static u64 hash(u64 key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  void grow() {
+    std::vector<u64> old_keys(keys.size() * 2, EMPTY_KEY);
+    std::vector<V> old_values(values.size() * 2);
+    old_keys.swap(keys);
+    old_values.swap(values);
+    count = 0;
+    for (size_t i = 0; i < old_keys.size(); i++) {
+      if (old_keys[i] != EMPTY_KEY)
+        insert(old_keys[i], old_values[i]);
+    }
+  }
+
+  std::vector<u64> keys;
+  std::vector<V> values;
+  size_t count;
+};
+
+template <class V> const u64 HashTable<V>::EMPTY_KEY;
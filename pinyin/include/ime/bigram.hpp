@@ -1,13 +1,20 @@
 #pragma once
 
+#include <cmath>
 #include <memory>
 
+#include "../csr.hpp"
+#include "../lattice.hpp"
 #include "../tables.hpp"
 #include "ime.hpp"
 
 struct BigramIMEOptions {
   /// The weight of bigram frequency
   double lambda = 0.999998;
+  /// The threshold of probability relative to the maximum (0 disables).
+  double filter_threshold = 0.;
+  /// The maximum number of candidates kept per position (0 disables).
+  size_t max_states = 0;
   /// Whether to use sos (<s>).
   bool use_sos = true;
   /// Whether to use eos (</s>).
@@ -26,19 +33,87 @@ public:
 
   /// Add sentence (GBK) to corpus
   void add_sentence(const char *sentence, size_t len);
+  /// Add sentence (UTF-8) to corpus
+  void add_utf8_sentence(const char *sentence, size_t len);
 
-  /// Finalize the processing of the corpus
+  /**
+   * Finalize the processing of the corpus.
+   *
+   * This freezes the dense bigram counting rows into a CSR table and releases
+   * them; no more sentences may be added afterwards.
+   */
   void build(const SyllableTable &sy_table);
 
+  /**
+   * Precomputes log probabilities of all bigram edges for the current
+   * `options`.
+   *
+   * Called by `build`; must be called again whenever `options.lambda` changes.
+   */
+  void prepare();
+
   std::string translate(const std::vector<Syllable> &syllables) const override;
+  std::vector<Candidate> translate_nbest(const std::vector<Syllable> &syllables,
+                                         size_t k) const override;
+  std::unique_ptr<DecodeSession> start_session() const override;
 
   BigramIMEOptions options;
 
 private:
+  class Session;
+
+  /**
+   * Counts the characters yielded by `next_char` until it returns `false`,
+   * between `<s>` and `</s>`. Characters not in the table end the sentence.
+   */
+  template <class F> void add_chars(F &&next_char);
+
+  /// Starts a lattice with `<s>`.
+  void start(Lattice<Char> &lattice) const;
+  /// Log probability of the edge from `ch1` to `ch2`.
+  float edge_score(Char ch1, Char ch2, bool use_bigram) const;
+  /**
+   * Stores the log probabilities of the edges from `ch1` to all characters of
+   * `syllable` to `edges`, in the order of `CharTable::chars`.
+   *
+   * The successors of `ch1` are merged with the sorted characters, instead of
+   * searching every character among them.
+   */
+  void gather_edges(Char ch1, Syllable syllable, bool use_bigram,
+                    float *edges) const;
+  /**
+   * Appends a position of `chars` to the lattice, which are the characters of
+   * `syllable` unless it is `INVALID_SYLLABLE`.
+   */
+  void extend(Lattice<Char> &lattice, const std::vector<Char> &chars,
+              Syllable syllable = INVALID_SYLLABLE) const;
+  /**
+   * Runs Viterbi over `syllables`, keeping `width` hypotheses per slot.
+   *
+   * The last slot of the returned (per-thread) lattice is `</s>`.
+   */
+  const Lattice<Char> &decode(const std::vector<Syllable> &syllables,
+                              u32 width) const;
+  /// Spells the path of a hypothesis ending at `</s>`.
+  std::string spell(const Lattice<Char> &lattice, u32 hyp) const;
+
   std::shared_ptr<CharTable> ch_table;
 
   std::vector<u64> unigram_freqs;
   u64 total;
 
+  /// Dense counting rows, only used before `build`.
   std::vector<std::vector<u64>> bigram_freqs;
+
+  /// Frozen bigram counts: sorted successors of each character.
+  std::vector<u64> bigram_offsets;
+  std::vector<Char> bigram_chars;
+  std::vector<u32> bigram_counts;
+  CsrView<Char, u32> bigrams;
+
+  /// Log probability of each bigram entry, parallel to `bigram_chars`.
+  std::vector<float> bigram_scores;
+  /// Log probability of each character after an unseen bigram.
+  std::vector<float> unigram_scores;
+  double prepared_lambda = NAN;
 };
@@ -1,6 +1,55 @@
 #pragma once
 
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "../common.hpp"
+#include "../tables.hpp"
+#include "../thread_pool.hpp"
+
+/// Outcome of translating a single sentence.
+struct TranslateResult {
+  bool ok;
+  /// The translation if `ok`, otherwise the error message.
+  std::string text;
+};
+
+/// A candidate sentence of `IME::translate_nbest`.
+struct Candidate {
+  /// UTF-8 text.
+  std::string text;
+  /// Log probability of the best path spelling `text`.
+  double score;
+};
+
+/**
+ * Incremental decoding of a sentence being typed.
+ *
+ * Keeps the lattice of the syllables typed so far, so that appending or
+ * removing a syllable only decodes the positions it affects. Obtained from
+ * `IME::start_session`; the IME must outlive it and keep its options.
+ */
+class DecodeSession {
+public:
+  DISABLE_COPY(DecodeSession);
+
+  DecodeSession() = default;
+  virtual ~DecodeSession() = default;
+
+  /// Appends a syllable.
+  virtual void push(Syllable syllable) = 0;
+  /// Removes the last syllable (backspace).
+  virtual void pop() = 0;
+  /// Number of syllables typed so far.
+  virtual size_t size() const = 0;
+
+  /**
+   * Translates the syllables typed so far, as `IME::translate` would.
+   */
+  virtual std::string text() = 0;
+};
 
 /**
  * Input Method Engine.
@@ -10,10 +59,75 @@ public:
   DISABLE_COPY(IME);
 
   IME() = default;
+  virtual ~IME() = default;
 
   /**
    * Translates a sequence of syllables to a UTF-8 string.
+   *
+   * Implementations must be safe to call concurrently; per-call scratch
+   * storage is kept per thread.
    */
   virtual std::string
   translate(const std::vector<Syllable> &syllables) const = 0;
+
+  /**
+   * Translates a sequence of syllables to the `k` best sentences, best first.
+   *
+   * The k best paths are kept in a single decoding pass. Paths spelling the
+   * same sentence (e.g. with different word segmentations) are merged, so
+   * fewer than `k` candidates may be returned; none for `k == 0`.
+   */
+  virtual std::vector<Candidate>
+  translate_nbest(const std::vector<Syllable> &syllables, size_t k) const = 0;
+
+  /**
+   * Starts an incremental decoding session with no syllables.
+   */
+  virtual std::unique_ptr<DecodeSession> start_session() const = 0;
+
+  /**
+   * Sets the number of worker threads used by `translate_batch`.
+   *
+   * With one thread (the default), batches are translated on the caller.
+   */
+  void set_threads(size_t threads);
+
+  /**
+   * Translates many sentences, in parallel if `set_threads` was called.
+   *
+   * Results are in the same order as `inputs`.
+   */
+  std::vector<TranslateResult>
+  translate_batch(const std::vector<std::vector<Syllable>> &inputs) const;
+
+protected:
+  /**
+   * Appends a candidate unless a better one with the same text exists.
+   *
+   * Candidates must be pushed best first.
+   */
+  static void push_candidate(std::vector<Candidate> &candidates,
+                             std::string text, double score);
+
+private:
+  std::unique_ptr<ThreadPool> pool;
 };
+
+/**
+ * Translates every line of `in` (space separated syllables) to `out`.
+ *
+ * Lines are processed in batches with `IME::translate_batch`; errors are
+ * reported to stderr and produce no output line.
+ */
+void translate_lines(const IME &ime, const SyllableTable &sy_table,
+                     std::istream &in, std::ostream &out);
+
+/**
+ * Reads every line of `in` (space separated syllables) for
+ * `IME::translate_batch`.
+ *
+ * Lines with an invalid syllable are reported to stderr and skipped, as in
+ * `translate_lines`.
+ */
+std::vector<std::vector<Syllable>>
+read_syllable_lines(const SyllableTable &sy_table, std::istream &in);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+
+#include "../common.hpp"
+
+/**
+ * Words sharing the same syllable sequence (pinyin).
+ */
+struct PinyinMatches {
+  std::vector<Word> words;
+  u64 freq;
+  u8 length;
+
+  PinyinMatches(u8 length) : freq(0), length(length) {}
+};
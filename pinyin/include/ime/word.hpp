@@ -1,22 +1,25 @@
 #pragma once
 
+#include <cmath>
 #include <memory>
 
-#include "../aho_corasick.hpp"
+#include "../candidate_index.hpp"
+#include "../codebook.hpp"
+#include "../lattice.hpp"
+#include "../ngram_model.hpp"
 #include "../tables.hpp"
 #include "ime.hpp"
 
-struct PinyinMatches {
-  std::vector<Word> words;
-  u64 freq;
-  u8 length;
-
-  PinyinMatches(u8 length) : freq(0), length(length) {}
-};
-
 struct WordIMEOptions {
   /// The weight of bigram frequency
   double lambda = 0.999998;
+  /// The threshold of probability relative to the maximum (0 disables).
+  double filter_threshold = 0.;
+  /// The maximum number of candidates kept per position (0 disables).
+  size_t max_states = 0;
+  /// The maximum number of candidates per pinyin, most frequent first (0
+  /// disables).
+  size_t max_candidates = 0;
   /// Debug mode.
   bool debug = false;
   /// Whether to use sos (<s>).
@@ -30,17 +33,71 @@ struct WordIMEOptions {
  */
 class WordIME : public IME {
 public:
+  /**
+   * Loads the dictionary at `dict_path`, either a ULEB dictionary
+   * (`dict_*.bin`) or a binary model image (`dict_*.model`).
+   */
   WordIME(std::shared_ptr<WordTable> word_table, const char *dict_path,
           WordIMEOptions options = {});
 
+  /**
+   * Precomputes log probabilities of all bigram edges for the current
+   * `options`.
+   *
+   * Called by the constructor; must be called again whenever `options.lambda`
+   * changes.
+   */
+  void prepare();
+
   std::string translate(const std::vector<Syllable> &syllables) const override;
+  std::vector<Candidate> translate_nbest(const std::vector<Syllable> &syllables,
+                                         size_t k) const override;
+  std::unique_ptr<DecodeSession> start_session() const override;
 
   WordIMEOptions options;
 
 private:
+  class Session;
+
+  /// Starts a lattice with `<s>`.
+  void start(Lattice<Word> &lattice) const;
+  /// Log probability of the edge from `word1` to `word2`.
+  float edge_score(Word word1, Word word2, bool use_bigram) const;
+  /**
+   * Scores the edges from `word1` to the first `n` words of a candidate group
+   * into `edges`.
+   *
+   * Edges start as the group's unseen-bigram scores; bigram scores are then
+   * gathered by merging the successors of `word1` with the group's words.
+   */
+  void gather_edges(Word word1, size_t n, size_t group, float *edges) const;
+  /**
+   * Adds `words`, spanning the last `length` syllables, to the new position.
+   *
+   * If `words` is (a prefix of) a candidate group, it is scored in batches.
+   */
+  void transit(Lattice<Word> &lattice, Span<Word> words, u8 length,
+               size_t group = CandidateIndex::NO_GROUP) const;
+  /**
+   * Appends the position of the last of `syllables`, the previous ones being
+   * already in the lattice.
+   */
+  void extend(Lattice<Word> &lattice, Span<Syllable> syllables) const;
+  /// Appends the `</s>` position. Returns whether it is reachable.
+  bool finish(Lattice<Word> &lattice) const;
+
+  /**
+   * Runs Viterbi over `syllables`, keeping `width` hypotheses per slot.
+   *
+   * The last slot of the returned (per-thread) lattice is `</s>`.
+   */
+  const Lattice<Word> &decode(const std::vector<Syllable> &syllables,
+                              u32 width) const;
+  /// Spells the path of a hypothesis ending at `</s>`.
+  std::string spell(const Lattice<Word> &lattice, u32 hyp) const;
+
   std::shared_ptr<WordTable> word_table;
-  std::vector<u64> unigram_freqs;
-  u64 total;
+  NgramModel model;
 
 #ifdef KN_SMOOTHING
   std::vector<u64> u2;
@@ -50,6 +107,21 @@ private:
   double D[2][3];
 #endif
 
-  std::vector<std::unordered_map<Word, u64>> bigram_freqs;
-  AhoCorasick<std::vector<Syllable>, PinyinMatches> pinyin_map;
+  /// Total frequency of the pinyin of each word.
+  std::vector<u64> sy_freqs;
+  /// Log probability of each bigram entry of `model`, quantized like it.
+  ScoreTable bigram_scores;
+#ifdef KN_SMOOTHING
+  /// log(b) and log(p), an unseen bigram scoring log(b[w1]) + log(p[w2]).
+  ScoreTable log_b, log_p;
+#else
+  /// Log probability of each word after an unseen bigram.
+  ScoreTable unigram_scores;
+  /// `unigram_scores` of the words of every candidate group, in their order.
+  ScoreTable group_unigram_scores;
+#endif
+  double prepared_lambda = NAN;
+
+  /// Candidate words of every pinyin.
+  CandidateIndex candidates;
 };
@@ -1,26 +1,26 @@
 #pragma once
 
+#include <cmath>
 #include <memory>
 
 #include "../aho_corasick.hpp"
+#include "../codebook.hpp"
+#include "../hash_table.hpp"
+#include "../lattice.hpp"
+#include "../ngram_model.hpp"
 #include "../tables.hpp"
 #include "ime.hpp"
-
-struct PinyinMatches {
-  std::vector<Word> words;
-  u64 freq;
-  u8 length;
-
-  PinyinMatches(u8 length) : freq(0), length(length) {}
-};
+#include "pinyin_matches.hpp"
 
 struct WordTriIMEOptions {
   /// The weight of trigram frequency
   double alpha = 0.999998;
   /// The weight of bigram frequency
   double beta = 0.9;
-  /// The threshold of probability relative to the maximum.
+  /// The threshold of probability relative to the maximum (0 disables).
   double filter_threshold = 1e-3;
+  /// The maximum number of states kept per position (0 disables).
+  size_t max_states = 0;
   /// Debug mode.
   bool debug = false;
   /// Whether to use sos (<s>).
@@ -34,19 +34,88 @@ struct WordTriIMEOptions {
  */
 class WordTriIME : public IME {
 public:
+  /**
+   * Loads the dictionary at `dict_path`, either a ULEB dictionary
+   * (`dict_tri_*.bin`) or a binary model image (`dict_tri_*.model`).
+   */
   WordTriIME(std::shared_ptr<WordTable> word_table, const char *dict_path,
              WordTriIMEOptions options = {});
 
+  /**
+   * Precomputes log probabilities of all n-gram edges for the current
+   * `options`.
+   *
+   * Called by the constructor; must be called again whenever `options.alpha`
+   * or `options.beta` changes.
+   */
+  void prepare();
+
   std::string translate(const std::vector<Syllable> &syllables) const override;
+  std::vector<Candidate> translate_nbest(const std::vector<Syllable> &syllables,
+                                         size_t k) const override;
+  std::unique_ptr<DecodeSession> start_session() const override;
 
   WordTriIMEOptions options;
 
 private:
+  class Session;
+
+  /// State (word1, word2), packed as `word1 << 32 | word2`.
+  using State = u64;
+
+  static State pack(Word word1, Word word2) {
+    return (u64)word1 << 32 | word2;
+  }
+  static Word word1_of(State state) { return state >> 32; }
+  static Word word2_of(State state) { return (Word)state; }
+
+  /// Lattice of states, with the slots of the position being built.
+  struct StateLattice {
+    Lattice<State> lattice;
+    /// Slot of each state of the last position.
+    HashTable<u32> slots;
+
+    void clear(u32 width) {
+      lattice.clear(width);
+      slots.clear();
+    }
+  };
+
+  /// Starts a lattice with `<s>`.
+  void start(StateLattice &sl) const;
+  /// Adds `words`, spanning the last `length` syllables, to the new position.
+  void transit(StateLattice &sl, const std::vector<Word> &words, u8 length,
+               double &layer_max_score) const;
+  /**
+   * Appends the position of `syllable`, given the automaton node of the
+   * previous syllables, and filters it. Returns the new node.
+   */
+  u32 extend(StateLattice &sl, u32 node, Syllable syllable) const;
+  /// Appends the `</s>` position. Returns whether it is reachable.
+  bool finish(StateLattice &sl) const;
+
+  /**
+   * Runs Viterbi over `syllables`, keeping `width` hypotheses per state.
+   *
+   * Slots of the returned (per-thread) lattice are states (word1, word2); the
+   * ones of the last position are the states (word, `</s>`).
+   */
+  const Lattice<State> &decode(const std::vector<Syllable> &syllables,
+                               u32 width) const;
+  /// Spells the path of a hypothesis ending with `</s>`.
+  std::string spell(const Lattice<State> &lattice, u32 hyp) const;
+
   std::shared_ptr<WordTable> word_table;
-  std::vector<u64> unigram_freqs;
-  u64 total;
+  NgramModel model;
 
-  std::vector<std::unordered_map<Word, u32>> bigram_freqs;
-  std::vector<std::unordered_map<u64, u32>> trigram_freqs;
+  /// Total frequency of the pinyin of each word.
+  std::vector<u64> sy_freqs;
+  /// Log probability of each trigram entry of `model`, quantized like it.
+  ScoreTable trigram_scores;
+  /// Log probability of each bigram entry of `model`, without trigram.
+  ScoreTable bigram_scores;
+  /// Log probability of each word, without trigram nor bigram.
+  ScoreTable unigram_scores;
+  double prepared_alpha = NAN, prepared_beta = NAN;
   AhoCorasick<std::vector<Syllable>, PinyinMatches> pinyin_map;
 };
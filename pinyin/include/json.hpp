@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "csr.hpp"
+#include "encoding.hpp"
+
+/**
+ * Single-pass extractor of top-level string fields from one-line JSON
+ * objects (JSONL).
+ *
+ * The whole object is tokenized, so keys may appear in any order and position,
+ * with any spacing, and nested values are skipped. Extracted values are left
+ * as raw slices of the line, still escaped; see `decode_json_string`. Nothing
+ * is allocated while parsing.
+ *
+ * With `gbk`, the line is GBK-encoded: double-byte characters are skipped as a
+ * whole, since their second byte may be a backslash.
+ *
+ * String contents are scanned a vector at a time for quotes, backslashes and
+ * line breaks together, so `parse_line` finds the end of a line in the same
+ * pass as its fields instead of scanning it twice.
+ */
+class JsonFieldExtractor {
+public:
+  JsonFieldExtractor(const std::vector<const char *> &keys, bool gbk);
+
+  /**
+   * Parses a JSON object. Returns `false` if it is malformed, in which case
+   * the fields are unspecified.
+   */
+  bool parse(Span<char> line);
+
+  enum class LineStatus { EMPTY, OK, MALFORMED };
+
+  /**
+   * Parses the line starting at `begin`, which ends at the first line break
+   * or at `end`, and sets `next` to the start of the following line.
+   *
+   * Blank lines are `EMPTY`; lines that are not a JSON object are
+   * `MALFORMED`, in which case the fields are unspecified.
+   */
+  LineStatus parse_line(const char *begin, const char *end, const char *&next);
+
+  size_t size() const { return keys.size(); }
+  /// Whether field `i` is present as a string in the last parsed object.
+  bool found(size_t i) const { return fields[i].found; }
+  /// Raw (escaped) value of field `i`.
+  Span<char> raw_value(size_t i) const { return fields[i].raw; }
+  /// Whether the raw value of field `i` contains escape sequences.
+  bool escaped(size_t i) const { return fields[i].escaped; }
+
+private:
+  struct Field {
+    bool found, escaped;
+    Span<char> raw;
+  };
+
+  /// Parses a JSON object and the whitespace after it, stopping at a line
+  /// break. Returns the end of the parsed text, or `nullptr` if malformed.
+  const char *parse_object(const char *p, const char *end);
+  /// Finds the closing quote of a string starting at `p`, after its opening
+  /// quote, or returns `nullptr`.
+  const char *scan_string(const char *p, const char *end,
+                          bool &escaped) const;
+  /// Skips a value other than a string, or returns `nullptr`.
+  const char *skip_value(const char *p, const char *end) const;
+
+  std::vector<std::string> keys;
+  std::vector<Field> fields;
+  bool gbk;
+  /// Start of the line being parsed.
+  const char *line_begin = nullptr;
+};
+
+/**
+ * Finds the first backslash of `[p, end)` starting an escape sequence, or
+ * returns `nullptr`.
+ */
+inline const char *find_json_escape(const char *p, const char *end, bool gbk) {
+  if (!gbk)
+    return (const char *)memchr(p, '\\', end - p);
+  while (p < end) {
+    if ((u8)*p >= 0x81) {
+      p += 2;
+    } else if (*p == '\\') {
+      return p;
+    } else {
+      p++;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Decodes the escape sequences of a raw JSON string, appending the result to
+ * `out`.
+ *
+ * Unescaped runs are appended by `append_raw(data, size)`, which may
+ * transcode them, and the code points of `\uXXXX` escapes, including
+ * surrogate pairs, by `append_codepoint(codepoint)`; other escapes are ASCII
+ * and appended as is. With `gbk`, double-byte characters are never taken for
+ * escapes. Returns `false` on an invalid escape sequence.
+ */
+template <class F, class G>
+bool decode_json_string(Span<char> raw, bool gbk, std::string &out,
+                        F &&append_raw, G &&append_codepoint) {
+  const char *p = raw.begin(), *end = raw.end();
+  auto hex4 = [&](const char *q, u32 &value) {
+    if (end - q < 4)
+      return false;
+    value = 0;
+    for (int k = 0; k < 4; k++) {
+      char c = q[k];
+      u32 digit;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        digit = (c | 0x20) - 'a' + 10;
+      } else {
+        return false;
+      }
+      value = value << 4 | digit;
+    }
+    return true;
+  };
+
+  while (p < end) {
+    auto backslash = find_json_escape(p, end, gbk);
+    if (!backslash) {
+      append_raw(p, end - p);
+      break;
+    }
+    if (backslash > p)
+      append_raw(p, backslash - p);
+    p = backslash + 1;
+    if (p == end)
+      return false;
+    switch (*p++) {
+    case '"':
+      out += '"';
+      break;
+    case '\\':
+      out += '\\';
+      break;
+    case '/':
+      out += '/';
+      break;
+    case 'b':
+      out += '\b';
+      break;
+    case 'f':
+      out += '\f';
+      break;
+    case 'n':
+      out += '\n';
+      break;
+    case 'r':
+      out += '\r';
+      break;
+    case 't':
+      out += '\t';
+      break;
+    case 'u': {
+      u32 code;
+      if (!hex4(p, code))
+        return false;
+      p += 4;
+      if (code >= 0xd800 && code < 0xdc00) {
+        u32 low;
+        if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !hex4(p + 2, low) ||
+            low < 0xdc00 || low >= 0xe000)
+          return false;
+        p += 6;
+        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+      } else if (code >= 0xdc00 && code < 0xe000) {
+        return false;
+      }
+      append_codepoint(code);
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+#include "common.hpp"
+#include "relax.hpp"
+#include "utils.hpp"
+
+/**
+ * Flat k-best Viterbi lattice.
+ *
+ * Candidates of every position are appended as contiguous slots, so a
+ * position is just a slot range. Each slot keeps the `width` best partial
+ * paths (hypotheses) ending at it, sorted by descending score; hypothesis
+ * `r` of slot `s` lives at index `s * width + r` of `scores` and `prevs`, and
+ * back-pointers are hypothesis indices. With the default width of 1,
+ * hypothesis and slot indices coincide and this is a plain Viterbi lattice.
+ *
+ * Scores are log probabilities, `-INFINITY` meaning unreachable. Storage is
+ * kept between uses; see `scratch_lattice`.
+ */
+template <class K> class Lattice {
+public:
+  /// Back-pointer of hypotheses without a predecessor.
+  static const u32 NO_SLOT = -1;
+
+  /**
+   * Removes all positions, keeping the allocated storage.
+   */
+  void clear(u32 width = 1) {
+    keys.clear();
+    scores.clear();
+    prevs.clear();
+    offsets.assign(1, 0);
+    this->width = width;
+  }
+
+  /**
+   * Removes all positions from `positions` on, keeping the storage.
+   *
+   * Hypotheses of the remaining positions are left untouched, since they only
+   * point backwards.
+   */
+  void truncate(size_t positions) {
+    assert(positions <= this->positions() && "Truncating past the end");
+    offsets.resize(positions + 1);
+    keys.resize(offsets.back());
+    scores.resize(hyp(offsets.back()));
+    prevs.resize(hyp(offsets.back()));
+  }
+
+  /**
+   * Appends a candidate to the current (last) position.
+   *
+   * `score` and `prev` initialize its best hypothesis. Returns the index of
+   * the new slot.
+   */
+  u32 add(const K &key, double score = -INFINITY, u32 prev = NO_SLOT) {
+    keys.push_back(key);
+    scores.push_back(score);
+    prevs.push_back(prev);
+    for (u32 r = 1; r < width; r++) {
+      scores.push_back(-INFINITY);
+      prevs.push_back(NO_SLOT);
+    }
+    return keys.size() - 1;
+  }
+
+  /**
+   * Offers a path ending at `slot`, coming from hypothesis `prev`.
+   *
+   * The path is kept if it is better than the worst hypothesis of the slot;
+   * ties keep the earlier path. Returns whether it was kept.
+   */
+  bool offer(u32 slot, double score, u32 prev) {
+    u32 first = slot * width, h = first + width - 1;
+    if (!(score > scores[h]))
+      return false;
+    for (; h > first && score > scores[h - 1]; h--) {
+      scores[h] = scores[h - 1];
+      prevs[h] = prevs[h - 1];
+    }
+    scores[h] = score;
+    prevs[h] = prev;
+    return true;
+  }
+
+  /**
+   * Offers the paths from hypothesis `prev` to the `n` slots from `first` on,
+   * scoring `scores[prev] + edges[k]` for slot `first + k`.
+   *
+   * Same as calling `offer` for every slot, but vectorized; only for a width
+   * of 1.
+   */
+  void offer_all(u32 first, const float *edges, size_t n, u32 prev) {
+    assert(width == 1 && "Batched offers need a width of 1");
+    relax_slots(scores[prev], edges, n, scores.data() + first,
+                prevs.data() + first, prev);
+  }
+
+  /**
+   * Prunes the slots of a finished position, making them unreachable.
+   *
+   * A slot is pruned when its best score is more than `-log_ratio` below the
+   * best one of the position (beam), or when it is not among the
+   * `max_slots` best ones (histogram; 0 keeps all). Ties keep earlier slots.
+   */
+  void prune(size_t position, double log_ratio, size_t max_slots) {
+    double max_score = -INFINITY;
+    for (u32 s = begin(position); s < end(position); s++) {
+      update_max(max_score, scores[hyp(s)]);
+    }
+    double threshold = max_score + log_ratio;
+
+    std::vector<double> &kept = prune_scores;
+    kept.clear();
+    for (u32 s = begin(position); s < end(position); s++) {
+      if (scores[hyp(s)] < threshold) {
+        unreach(s);
+      } else if (scores[hyp(s)] != -INFINITY) {
+        kept.push_back(scores[hyp(s)]);
+      }
+    }
+    if (!max_slots || kept.size() <= max_slots)
+      return;
+
+    // Keep slots above the `max_slots`-th best score, then ties in order
+    std::nth_element(kept.begin(), kept.begin() + max_slots - 1, kept.end(),
+                     std::greater<double>());
+    double kth = kept[max_slots - 1];
+    size_t above = 0;
+    for (auto score : kept) {
+      above += score > kth;
+    }
+    size_t ties = max_slots - above;
+    for (u32 s = begin(position); s < end(position); s++) {
+      double score = scores[hyp(s)];
+      if (score < kth) {
+        unreach(s);
+      } else if (score == kth) {
+        if (ties) {
+          ties--;
+        } else {
+          unreach(s);
+        }
+      }
+    }
+  }
+
+  /**
+   * Finishes the current position and starts a new one.
+   */
+  void next_position() { offsets.push_back(keys.size()); }
+
+  /// Number of finished positions.
+  size_t positions() const { return offsets.size() - 1; }
+
+  /// Slot range of a finished position.
+  u32 begin(size_t position) const { return offsets[position]; }
+  u32 end(size_t position) const { return offsets[position + 1]; }
+
+  /// Total number of slots.
+  u32 size() const { return keys.size(); }
+
+  /// Number of hypotheses per slot.
+  u32 hyp_width() const { return width; }
+  /// Index of hypothesis `rank` of `slot`.
+  u32 hyp(u32 slot, u32 rank = 0) const { return slot * width + rank; }
+  /// Slot of a hypothesis.
+  u32 slot_of(u32 hyp) const { return hyp / width; }
+
+  /**
+   * Gets the slots along the path of a hypothesis, from the first position.
+   */
+  std::vector<u32> path(u32 hyp) const {
+    std::vector<u32> slots;
+    for (; hyp != NO_SLOT; hyp = prevs[hyp]) {
+      slots.push_back(slot_of(hyp));
+    }
+    return std::vector<u32>(slots.rbegin(), slots.rend());
+  }
+
+  std::vector<K> keys;
+  std::vector<double> scores;
+  std::vector<u32> prevs;
+
+private:
+  void unreach(u32 slot) {
+    for (u32 h = hyp(slot); h < hyp(slot + 1); h++) {
+      scores[h] = -INFINITY;
+      prevs[h] = NO_SLOT;
+    }
+  }
+
+  std::vector<u32> offsets = {0};
+  std::vector<double> prune_scores;
+  u32 width = 1;
+};
+
+template <class K> const u32 Lattice<K>::NO_SLOT;
+
+/**
+ * Gets the lattice reused by all decodes on the calling thread, keeping
+ * `width` hypotheses per slot.
+ */
+template <class K> Lattice<K> &scratch_lattice(u32 width = 1) {
+  static thread_local Lattice<K> lattice;
+  lattice.clear(width);
+  return lattice;
+}
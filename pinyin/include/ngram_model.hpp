@@ -0,0 +1,225 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "csr.hpp"
+#include "utils.hpp"
+
+/**
+ * Header of the binary n-gram model image.
+ *
+ * The image is laid out as the header followed by these sections, each
+ * starting at an 8-byte aligned offset:
+ *
+ *   uU   unigrams[word_count]
+ *   uO   bigram_offsets[word_count + 1]
+ *   Word bigram_words[bigram_count]
+ *   uN   bigram_counts[bigram_count]
+ *   uO   trigram_offsets[bigram_count + 1]   (order 3 only)
+ *   Word trigram_words[trigram_count]        (order 3 only)
+ *   uN   trigram_counts[trigram_count]       (order 3 only)
+ *   u64  unigram_codebook[unigram_codebook_size]
+ *   u32  bigram_codebook[bigram_codebook_size]
+ *   u32  trigram_codebook[trigram_codebook_size]
+ *
+ * where N is `count_bits`, U is 64 for N = 32 and N otherwise, and O is
+ * `offset_bits`. With N < 32 the counts are codes into the codebooks, see
+ * `NgramModel::quantize`. Offsets take 32 bits unless there are 2^32 n-grams
+ * of an order or more.
+ *
+ * Bigram successors of a word, and trigram successors of a bigram entry, are
+ * sorted ascendingly so they can be binary searched in place.
+ */
+struct NgramModelHeader {
+  char magic[8];
+  u32 version;
+  u32 order;
+  u64 word_count;
+  u64 total;
+  u64 bigram_count;
+  u64 trigram_count;
+  u32 count_bits;
+  u32 offset_bits;
+  /// Number of codebook entries, 0 with 32-bit counts.
+  u32 unigram_codebook_size;
+  u32 bigram_codebook_size;
+  u32 trigram_codebook_size;
+};
+
+const char NGRAM_MODEL_MAGIC[8] = {'P', 'Y', 'N', 'G', 'R', 'A', 'M', 0};
+const u32 NGRAM_MODEL_VERSION = 3;
+
+/**
+ * Read-only array of n-gram counts stored as `T`, or as 8 / 16-bit codes
+ * into a codebook.
+ */
+template <class T> class CountArray {
+public:
+  CountArray() : data(nullptr), bits(32) {}
+  CountArray(const void *data, u32 bits, Span<T> codebook)
+      : data(data), bits(bits), codebook(codebook) {}
+
+  T operator[](u64 index) const {
+    switch (bits) {
+    case 8:
+      return codebook[((const u8 *)data)[index]];
+    case 16:
+      return codebook[((const u16 *)data)[index]];
+    default:
+      return ((const T *)data)[index];
+    }
+  }
+
+private:
+  const void *data;
+  u32 bits;
+  Span<T> codebook;
+};
+
+/**
+ * Read-only array of CSR offsets stored with 32 or 64 bits.
+ */
+class OffsetArray {
+public:
+  OffsetArray() : ptr(nullptr), len(0), bits(64) {}
+  OffsetArray(const void *ptr, size_t len, u32 bits)
+      : ptr(ptr), len(len), bits(bits) {}
+
+  u64 operator[](size_t index) const {
+    return bits == 32 ? ((const u32 *)ptr)[index] : ((const u64 *)ptr)[index];
+  }
+
+  const void *data() const { return ptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+  /// Size of the array in bytes.
+  size_t bytes() const { return len * bits / 8; }
+
+private:
+  const void *ptr;
+  size_t len;
+  u32 bits;
+};
+
+/// CSR table of an n-gram model, with offsets narrowed where possible.
+using NgramTable = CsrView<Word, u32, OffsetArray>;
+
+/**
+ * Word n-gram counts, stored as flat CSR arrays.
+ *
+ * The model is either parsed from a ULEB dictionary (`dict_*.bin`) into an
+ * in-memory image, or memory-mapped from a binary image (`dict_*.model`) and
+ * queried in place without any parsing.
+ */
+class NgramModel {
+public:
+  DISABLE_COPY(NgramModel);
+
+  NgramModel() = default;
+
+  /**
+   * Loads a model of the given order (2 or 3) for `word_count` words.
+   *
+   * Binary images are detected by their magic and memory-mapped; other files
+   * are parsed as ULEB dictionaries written by `make-dict`.
+   */
+  void load(const char *path, size_t word_count, u32 order);
+
+  /**
+   * Writes the binary image of this model.
+   */
+  void save(const char *path) const;
+
+  /**
+   * Replaces the unigram, bigram and trigram counts with `bits`-bit (8 or 16)
+   * codes into per-order codebooks, built from the counts themselves.
+   *
+   * The model must not be quantized yet.
+   */
+  void quantize(u32 bits);
+
+  u32 order() const { return header->order; }
+  u32 count_bits() const { return header->count_bits; }
+  /// Size of the binary image in bytes.
+  size_t image_bytes() const { return image_size; }
+  size_t size() const { return header->word_count; }
+  u64 total() const { return header->total; }
+
+  u64 unigram(Word word) const { return unigrams[word]; }
+
+  /// Sorted successors of `word`.
+  Span<Word> successors(Word word) const { return bigrams.row_keys(word); }
+
+  /**
+   * Gets the index of bigram (word1, word2), or `INVALID_INDEX`.
+   */
+  u64 bigram_index(Word word1, Word word2) const {
+    return bigrams.find(word1, word2);
+  }
+  u32 bigram(Word word1, Word word2) const {
+    auto index = bigram_index(word1, word2);
+    return index == INVALID_INDEX ? 0 : bigram_counts[index];
+  }
+  u32 bigram_count(u64 index) const { return bigram_counts[index]; }
+  u32 trigram_count(u64 index) const { return trigram_counts[index]; }
+
+  /**
+   * Gets the count of trigram (word1, word2, word3).
+   */
+  u32 trigram(Word word1, Word word2, Word word3) const {
+    auto index = bigram_index(word1, word2);
+    return index == INVALID_INDEX ? 0 : trigram_at(index, word3);
+  }
+  /**
+   * Gets the count of trigram (word1, word2, word3), given the index of
+   * bigram (word1, word2).
+   */
+  u32 trigram_at(u64 bigram_index, Word word3) const {
+    auto index = trigram_index(bigram_index, word3);
+    return index == INVALID_INDEX ? 0 : trigram_counts[index];
+  }
+  /**
+   * Gets the index of trigram (word1, word2, word3) given the index of bigram
+   * (word1, word2), or `INVALID_INDEX`.
+   */
+  u64 trigram_index(u64 bigram_index, Word word3) const {
+    return trigrams.find(bigram_index, word3);
+  }
+
+  /**
+   * Raw CSR tables, rows of the trigram table being bigram entries.
+   *
+   * Only offsets and keys are set; counts are read with `bigram_count` and
+   * `trigram_count`.
+   */
+  const NgramTable &bigram_table() const { return bigrams; }
+  const NgramTable &trigram_table() const { return trigrams; }
+
+private:
+  /// A section of an image being assembled.
+  struct Section {
+    const void *data;
+    size_t size;
+  };
+
+  void load_uleb(const u8 *ptr, const u8 *end, size_t word_count, u32 order);
+  void assemble(const NgramModelHeader &h,
+                const std::vector<Section> &sections);
+  void attach(const u8 *image, size_t size);
+
+  std::unique_ptr<MappedFile> file;
+  std::vector<u64> owned;
+
+  const NgramModelHeader *header = nullptr;
+  const u8 *image = nullptr;
+  size_t image_size = 0;
+
+  CountArray<u64> unigrams;
+  NgramTable bigrams;
+  NgramTable trigrams;
+  CountArray<u32> bigram_counts;
+  CountArray<u32> trigram_counts;
+};
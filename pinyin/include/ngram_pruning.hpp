@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cmath>
+
+#include "common.hpp"
+
+/**
+ * Pruning applied by `make-dict` before writing a dictionary.
+ *
+ * N-grams are first dropped by count, then by relative entropy (Stolcke
+ * pruning): an n-gram is dropped when removing it from the interpolated model
+ * changes the model by less than `entropy_threshold` nats, as estimated by
+ * `pruning_entropy`. Dropping a bigram also drops its trigrams.
+ */
+struct NgramPruningOptions {
+  /// Bigrams seen fewer times are dropped (1 keeps all).
+  u64 min_bigram_count = 1;
+  /// Trigrams seen fewer times are dropped (1 keeps all).
+  u64 min_trigram_count = 1;
+  /// The relative entropy threshold (0 disables entropy pruning).
+  double entropy_threshold = 0.;
+};
+
+/**
+ * Estimates the relative entropy between an interpolated model and the same
+ * model without n-gram (h, w).
+ *
+ * With `weight` = λ, the model estimates P(w | h) = λ c(h, w) / c(h) +
+ * (1 - λ) P_lower(w), and P_lower(w) alone once the n-gram is removed. As
+ * the other n-grams of h keep their probabilities, the difference reduces to
+ * P(h, w) log(P(w | h) / ((1 - λ) P_lower(w))), with P(h, w) = c(h, w) / N.
+ */
+inline double pruning_entropy(u64 count, u64 history_count, double lower_prob,
+                              u64 total, double weight) {
+  double backoff = (1 - weight) * lower_prob;
+  double prob = weight * count / history_count + backoff;
+  return (double)count / total * (std::log(prob) - std::log(backoff));
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+#include "common.hpp"
+
+/**
+ * Relaxes `n` Viterbi slots with the paths from one predecessor.
+ *
+ * For every `k`, if `base + edges[k] > scores[k]`, sets `scores[k]` to it and
+ * `prevs[k]` to `prev`. The sum is computed in double precision, so this is
+ * exactly a loop of `Lattice::offer` with a width of 1.
+ *
+ * Runs 8 or 4 lanes at a time with AVX-512 or AVX2 when the CPU supports them
+ * (checked once, at the first call), and one at a time otherwise.
+ */
+void relax_slots(double base, const float *edges, size_t n, double *scores,
+                 u32 *prevs, u32 prev);
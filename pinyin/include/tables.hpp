@@ -1,15 +1,28 @@
 #pragma once
 
-#include <iconv.h>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <unordered_map>
 #include <vector>
 
 #include "common.hpp"
+#include "csr.hpp"
+
+/// Outcome of `SyllableTable::split`.
+enum class SplitStatus {
+  OK,
+  /// A token is not a syllable of the table.
+  UNKNOWN_SYLLABLE,
+};
 
 /**
  * Table mapping syllables into indices.
+ *
+ * Syllables made of at most 12 lowercase letters, i.e. all pinyin, are packed
+ * into integers and looked up with a perfect hash; other syllables fall back
+ * to a hash map of strings. The perfect hash is built once by `build` (called
+ * by `init_tables`) after all insertions, and `get` asserts that it was.
  */
 class SyllableTable {
 public:
@@ -20,15 +33,23 @@ public:
   /**
    * Inserts a syllable string into the table.
    *
-   * Returns the index of the inserted syllable.
+   * Returns the index of the inserted syllable. `build` must be called after
+   * all insertions.
    */
   Syllable insert(const std::string &key);
+  /**
+   * Builds the perfect hash used by lookups.
+   */
+  void build();
   /**
    * Retrieves the index of a syllable string.
    *
    * Returns `INVALID_SYLLABLE` if the syllable is not in the table.
    */
-  Syllable get(const std::string &key) const;
+  Syllable get(const std::string &key) const {
+    return get(Span<char>(key.data(), key.size()));
+  }
+  Syllable get(Span<char> key) const;
 
   /**
    * Retrieves the syllable string corresponding to an index.
@@ -46,24 +67,46 @@ public:
    */
   std::vector<Syllable> split(const std::string &seq) const;
 
+  /**
+   * Splits a sequence of syllable strings, appending the syllables to `out`.
+   *
+   * Tokens are looked up in place, without allocating. On an unknown
+   * syllable, `UNKNOWN_SYLLABLE` is returned and `error` (if given) is set to
+   * the token; `out` then ends with the syllables before it.
+   */
+  SplitStatus split(Span<char> seq, std::vector<Syllable> &out,
+                    Span<char> *error = nullptr) const;
+
 private:
+  /// Packs a lowercase key 5 bits per letter, or returns 0 if impossible.
+  static u64 pack(Span<char> key);
+
   std::unordered_map<std::string, Syllable> table;
   std::vector<std::string> spellings;
+
+  /**
+   * Perfect hash of packed keys (hash and displace): a key hashes to a
+   * bucket, whose displacement selects a slot free of collisions.
+   */
+  std::vector<u32> displacements;
+  std::vector<u64> slot_keys;
+  std::vector<Syllable> slot_values;
+  bool built = false;
 };
 
 const size_t GBK_CHAR_COUNT = 23940;
 
 /**
  * Table mapping syllable into GBK characters, character into indices.
+ *
+ * Characters are indexed both by their GBK bytes and by their Unicode code
+ * point, so UTF-8 text needs no transcoding.
  */
 class CharTable {
 public:
   DISABLE_COPY(CharTable);
 
-  CharTable()
-      : ic(iconv_open("UTF-8", "GBK")), allocated(2), utf8_chars({"", ""}) {}
-
-  ~CharTable() { iconv_close(ic); }
+  CharTable() : allocated(2), utf8_chars({"", ""}) {}
 
   /**
    * Inserts a character string into the table.
@@ -79,11 +122,22 @@ public:
    * Returns `INVALID_CHAR` if the character is not in the table.
    */
   Char get(const char *start) const;
+  /**
+   * Retrieves the index of a character by its code point.
+   *
+   * Returns `INVALID_CHAR` if the character is not in the table.
+   */
+  Char get_codepoint(u32 codepoint) const {
+    if (codepoint >= 0x10000 || !pages[codepoint >> 8])
+      return INVALID_CHAR;
+    Char result = pages[codepoint >> 8][codepoint & 0xff];
+    return result ? result : INVALID_CHAR;
+  }
 
   /**
    * Inserts a syllable-character pair into the table.
    */
-  void insert(Syllable syllable, Char ch) { sy_chars[syllable].push_back(ch); }
+  void insert(Syllable syllable, Char ch);
 
   /// Start of sentence character.
   Char sos() const { return 0; }
@@ -95,7 +149,17 @@ public:
   /**
    * Retrieves the list of characters corresponding to a syllable.
    */
-  std::vector<Char> chars(Syllable syllable) const;
+  const std::vector<Char> &chars(Syllable syllable) const {
+    return find_chars(syllable).chars;
+  }
+  /// Characters of a syllable sorted by index.
+  const std::vector<Char> &sorted_chars(Syllable syllable) const {
+    return find_chars(syllable).sorted;
+  }
+  /// Positions in `chars(syllable)` of `sorted_chars(syllable)`.
+  const std::vector<u32> &sorted_ranks(Syllable syllable) const {
+    return find_chars(syllable).ranks;
+  }
 
   /**
    * Retrieves the UTF-8 character string corresponding to an index.
@@ -103,20 +167,65 @@ public:
   const std::string &utf8_char(Char ch) const { return utf8_chars[ch]; }
 
 private:
-  iconv_t ic;
+  /// Characters of a syllable, in insertion order and sorted by index.
+  struct SyllableChars {
+    std::vector<Char> chars, sorted;
+    std::vector<u32> ranks;
+  };
+
+  const SyllableChars &find_chars(Syllable syllable) const;
+
   Char table[GBK_CHAR_COUNT], allocated;
+  /**
+   * Indices by code point, in pages of 256 code points allocated on demand.
+   * GBK only covers the BMP, and the CJK blocks are dense.
+   */
+  std::unique_ptr<Char[]> pages[0x100];
   std::vector<std::string> utf8_chars;
-  std::unordered_map<Syllable, std::vector<Char>> sy_chars;
+  std::unordered_map<Syllable, SyllableChars> sy_chars;
 };
 
+/**
+ * Header of the binary word table image.
+ *
+ * The image is laid out as the header followed by these sections, each
+ * starting at an 8-byte aligned offset:
+ *
+ *   u32      word_offsets[word_count + 1]
+ *   char     arena[arena_size]
+ *   u32      pinyin_offsets[word_count + 1]
+ *   Syllable syllables[syllable_count]
+ *   Word     slots[slot_count]
+ *
+ * Pinyins are resolved: words without an explicit pinyin carry the inferred
+ * one, so a loaded table needs neither splitting nor inference.
+ */
+struct WordTableHeader {
+  char magic[8];
+  u32 version;
+  u32 reserved;
+  u64 word_count;
+  u64 arena_size;
+  u64 syllable_count;
+  u64 slot_count;
+  u64 indexed;
+};
+
+const char WORD_TABLE_MAGIC[8] = {'P', 'Y', 'W', 'O', 'R', 'D', 'S', 0};
+const u32 WORD_TABLE_VERSION = 1;
+
 /**
  * Table mapping word into indices & pinyin, indices into words.
+ *
+ * Words are interned in a single byte arena and pinyins in a single syllable
+ * pool, both addressed by offsets; the hash index stores word indices only.
+ * This needs no allocation per word.
  */
 class WordTable {
 public:
   DISABLE_COPY(WordTable);
 
-  WordTable() : words({"<s>", "</s>"}), pinyins({{}, {}}) {}
+  WordTable();
 
   /// Start of sentence word (<s>).
   Word sos() const { return 0; }
@@ -128,23 +237,33 @@ public:
    *
    * Returns the index of the inserted word.
    */
-  Word insert(const std::string &key, std::vector<Syllable> pinyin);
+  Word insert(Span<char> key, Span<Syllable> pinyin);
+  Word insert(const std::string &key, Span<Syllable> pinyin) {
+    return insert(Span<char>(key.data(), key.size()), pinyin);
+  }
   /**
    * Retrieves the index of a word string.
    *
    * Returns `INVALID_WORD` if the word is not in the table.
    */
-  Word get(const std::string &key) const;
+  Word get(Span<char> key) const;
+  Word get(const std::string &key) const {
+    return get(Span<char>(key.data(), key.size()));
+  }
 
-  size_t size() const { return table.size() + 2; }
+  size_t size() const { return word_offsets.size() - 1; }
 
   /**
-   * Retrieves the word string corresponding to an index.
+   * Retrieves the word string corresponding to an index, valid until the next
+   * insertion.
    *
    * This handles `INVALID_WORD` as well (returns <unk>).
    */
-  const std::string &word(Word word) const;
-  const std::vector<Syllable> &pinyin(Word word) const { return pinyins[word]; }
+  Span<char> word(Word word) const;
+  Span<Syllable> pinyin(Word word) const {
+    return Span<Syllable>(syllables.data() + pinyin_offsets[word],
+                          pinyin_offsets[word + 1] - pinyin_offsets[word]);
+  }
 
   /**
    * Infer the syllable sequence (pinyin) of a word.
@@ -154,8 +273,41 @@ public:
    */
   std::vector<Syllable> infer_pinyin(Word word) const;
 
+  /**
+   * Whether pinyins are resolved, i.e. an empty pinyin means that none can be
+   * inferred either. True for tables loaded from an image.
+   */
+  bool pinyin_resolved() const { return resolved; }
+
+  /**
+   * Writes the binary image of this table, with inferred pinyins resolved.
+   */
+  void save(const char *path) const;
+
+  /**
+   * Replaces the content of this table with a binary image written by `save`.
+   *
+   * The sections are copied as is, the hash index included, so nothing is
+   * parsed or rebuilt.
+   */
+  void load(const char *path);
+
 private:
-  std::unordered_map<std::string, Word> table;
-  std::vector<std::string> words;
-  std::vector<std::vector<Syllable>> pinyins;
+  /// Appends a word to the arena and pools, without indexing it.
+  Word append(Span<char> key, Span<Syllable> pinyin);
+  /// Slot of `key` in the hash index: either holding it, or empty.
+  size_t find_slot(Span<char> key, u64 hash) const;
+  void grow_index();
+
+  /// Word `w` is `arena[word_offsets[w], word_offsets[w + 1])`.
+  std::string arena;
+  std::vector<u32> word_offsets;
+  /// Pinyin of word `w` is
+  /// `syllables[pinyin_offsets[w], pinyin_offsets[w + 1])`.
+  std::vector<Syllable> syllables;
+  std::vector<u32> pinyin_offsets;
+  /// Open-addressing index of words other than <s> and </s>.
+  std::vector<Word> slots;
+  size_t indexed = 0;
+  bool resolved = false;
 };
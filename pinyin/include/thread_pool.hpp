@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+
+/**
+ * Fixed-size pool of worker threads.
+ */
+class ThreadPool {
+public:
+  DISABLE_COPY(ThreadPool);
+
+  explicit ThreadPool(size_t threads);
+  ~ThreadPool();
+
+  size_t size() const { return workers.size(); }
+
+  /**
+   * Invokes `f(i)` for every `i` in `[0, n)` on the workers, and returns after
+   * all invocations finished.
+   *
+   * `f` must not throw. Calls from different threads are serialized.
+   */
+  void parallel_for(size_t n, const std::function<void(size_t)> &f);
+
+private:
+  void work();
+
+  std::vector<std::thread> workers;
+
+  std::mutex submit_mutex;
+  std::mutex mutex;
+  std::condition_variable job_cv, done_cv;
+
+  const std::function<void(size_t)> *job = nullptr;
+  size_t job_size = 0;
+  std::atomic<size_t> next_index;
+  size_t busy = 0;
+  u64 generation = 0;
+  bool stopping = false;
+};
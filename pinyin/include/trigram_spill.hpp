@@ -0,0 +1,115 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+
+/**
+ * Count of a trigram, as stored in spilled runs.
+ */
+struct TrigramRecord {
+  Word word1, word2, word3;
+  u32 count;
+
+  bool operator<(const TrigramRecord &other) const {
+    if (word1 != other.word1)
+      return word1 < other.word1;
+    if (word2 != other.word2)
+      return word2 < other.word2;
+    return word3 < other.word3;
+  }
+  bool same_key(const TrigramRecord &other) const {
+    return word1 == other.word1 && word2 == other.word2 &&
+           word3 == other.word3;
+  }
+};
+
+/**
+ * Memory-bounded trigram counter spilling sorted runs to disk.
+ *
+ * Occurrences are appended to a buffer of at most `buffer_size` records.
+ * When it is full, equal trigrams are combined, and if that does not free
+ * half of the buffer it is written as a sorted run to `<prefix>.<k>`. Run
+ * files are removed on destruction. Read the counts back with
+ * `TrigramMerger`.
+ */
+class TrigramSpill {
+public:
+  DISABLE_COPY(TrigramSpill);
+
+  TrigramSpill(std::string prefix, size_t buffer_size);
+  ~TrigramSpill();
+
+  void add(Word word1, Word word2, Word word3) {
+    if (buffer.size() == buffer_size)
+      compact();
+    buffer.push_back({word1, word2, word3, 1});
+  }
+
+  /**
+   * Spills the remaining buffer and releases it.
+   */
+  void finish();
+
+  /**
+   * Maps the words of all runs through `word_map`, restoring their order.
+   *
+   * Only valid after `finish`. Each run is rewritten in place, one at a time,
+   * so this needs no more memory than counting did.
+   */
+  void remap(const std::vector<Word> &word_map);
+
+  /**
+   * Merges runs until at most `max_runs` are left, bounding the number of
+   * files opened by `TrigramMerger`. Only valid after `finish`.
+   */
+  void merge_runs(size_t max_runs);
+
+  const std::vector<std::string> &runs() const { return paths; }
+
+private:
+  void compact();
+  void spill();
+  std::string next_path();
+
+  std::string prefix;
+  size_t buffer_size;
+  std::vector<TrigramRecord> buffer;
+  std::vector<std::string> paths;
+  size_t run_count = 0;
+};
+
+/**
+ * K-way merge of sorted trigram runs.
+ *
+ * Yields every distinct trigram once in ascending order, with its counts
+ * summed over all runs. Only one block of records per run is kept in memory,
+ * but every run stays open.
+ */
+class TrigramMerger {
+public:
+  DISABLE_COPY(TrigramMerger);
+
+  explicit TrigramMerger(const std::vector<std::string> &paths);
+  ~TrigramMerger();
+
+  /**
+   * Reads the next trigram into `record`. Returns `false` at the end.
+   */
+  bool next(TrigramRecord &record);
+
+private:
+  struct Run;
+
+  /// Pops the smallest record of all runs.
+  bool pop(TrigramRecord &record);
+
+  std::vector<std::unique_ptr<Run>> runs;
+  /// Min-heap of run indices, by their current record.
+  std::vector<size_t> heap;
+  TrigramRecord pending;
+  bool has_pending = false;
+};
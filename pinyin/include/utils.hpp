@@ -19,6 +19,9 @@ template <class T> bool update_max(T &max, const T &new_val) {
   return false;
 }
 
+/// Rounds `size` up to a multiple of 8, the alignment of image sections.
+inline size_t align8(size_t size) { return (size + 7) & ~(size_t)7; }
+
 /**
  * Splits a string by spaces and applies a function to each substring.
  */
@@ -53,12 +56,46 @@ template <class F> void read_lines(const char *filename, F &&handler) {
  * Reads a ULEB128 encoded value from a stream.
  */
 u64 read_uleb(std::istream &in);
+/**
+ * Reads a ULEB128 encoded value from memory, advancing `ptr`.
+ */
+u64 read_uleb(const u8 *&ptr);
 
 /**
  * Writes a ULEB128 encoded value to a stream.
  */
 void write_uleb(std::ostream &out, u64 value);
 
+/**
+ * Read-only memory mapping of a whole file.
+ *
+ * Pages are shared with the page cache, so several processes mapping the same
+ * file only keep one copy of it in memory.
+ */
+class MappedFile {
+public:
+  DISABLE_COPY(MappedFile);
+
+  /**
+   * Maps the given file. Throws `std::runtime_error` on failure.
+   */
+  explicit MappedFile(const char *filename);
+  ~MappedFile();
+
+  const u8 *data() const { return ptr; }
+  size_t size() const { return len; }
+
+  /**
+   * Hints that the mapping will be read sequentially, enabling aggressive
+   * read-ahead.
+   */
+  void advise_sequential() const;
+
+private:
+  const u8 *ptr;
+  size_t len;
+};
+
 /**
  * Loads a set of punctuation characters from `extra/punctuations.txt`.
  */
@@ -0,0 +1,427 @@
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+
+#include "ime/bigram.hpp"
+#include "ime/ime.hpp"
+#include "ime/word.hpp"
+#include "ime/word_tri.hpp"
+
+#include "corpus.hpp"
+#include "tables.hpp"
+
+/**
+ * Decoder benchmark.
+ *
+ * Loads a model the same way as the corresponding driver (`main`, `main_word`
+ * or `main_word_tri`), then translates every line from stdin `--repeat` times
+ * with `--threads` workers and reports the throughput. With `--nbest K`, the
+ * latency of `translate_nbest` is also reported for k = 1, 2, 4, ..., K.
+ * With `--session`, every line is also typed one syllable at a time into a
+ * `DecodeSession`, and the per-keystroke latency is compared to translating
+ * every prefix from scratch.
+ *
+ * Pruning is set with `--filter T` (`filter_threshold`) and `--max-states N`.
+ * With `--answer FILE`, sentence accuracy against the expected outputs is
+ * reported too, along with their per-character perplexity; `--sweep`
+ * measures accuracy and throughput for a grid of pruning settings instead.
+ * `--dict FILE` loads another dictionary of the word models, e.g. a quantized
+ * one.
+ *
+ * `bench corpus <dataset>` measures corpus ingestion instead: every string of
+ * the dataset is read `--repeat` times, without further processing.
+ *
+ * `bench split` measures syllable splitting of the lines from stdin: the
+ * zero-copy `SyllableTable::split` against splitting into strings looked up in
+ * a hash map.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::unique_ptr<IME> load_ime(const std::string &model,
+                              const std::string &dataset,
+                              const std::string &dict_override,
+                              std::shared_ptr<SyllableTable> sy_table,
+                              std::shared_ptr<CharTable> ch_table) {
+  if (model == "char") {
+    std::unique_ptr<BigramIME> ime(new BigramIME(ch_table));
+    CorpusOptions options;
+    get_dataset_options(dataset, options);
+    options.raw = true;
+    read_corpus(options, [&](Span<char> text) {
+      if (options.utf8) {
+        ime->add_utf8_sentence(text.data(), text.size());
+      } else {
+        ime->add_sentence(text.data(), text.size());
+      }
+    });
+    ime->build(*sy_table);
+    ime->options.lambda = 0.95;
+    ime->prepare();
+    return std::move(ime);
+  }
+
+  std::string prefix;
+  if (model == "word") {
+    prefix = "extra/dict_";
+  } else if (model == "word_tri") {
+    prefix = "extra/dict_tri_";
+  } else {
+    throw std::runtime_error("Unknown model: " + model);
+  }
+
+  auto word_table = std::make_shared<WordTable>();
+  if (!load_dict_words(*sy_table, *word_table, prefix + "words_" + dataset)) {
+    throw std::runtime_error("Failed to open words of " + prefix + dataset);
+  }
+
+  auto dict_path = prefix + dataset + ".model";
+  if (!dict_override.empty()) {
+    dict_path = dict_override;
+  } else if (!std::ifstream(dict_path)) {
+    dict_path = prefix + dataset + ".bin";
+  }
+  if (model == "word") {
+    return std::unique_ptr<IME>(new WordIME(word_table, dict_path.data()));
+  }
+  std::unique_ptr<WordTriIME> ime(new WordTriIME(word_table, dict_path.data()));
+  ime->options.alpha = 0.999998;
+  ime->options.beta = 0.15;
+  ime->prepare();
+  return std::move(ime);
+}
+
+/**
+ * Sets the pruning options of an IME, leaving NaN / negative values as is.
+ */
+template <class Options>
+static void set_pruning(Options &options, double filter_threshold,
+                        int max_states) {
+  if (!std::isnan(filter_threshold))
+    options.filter_threshold = filter_threshold;
+  if (max_states >= 0)
+    options.max_states = max_states;
+}
+
+static int bench_corpus(const std::string &dataset, size_t repeat) {
+  CorpusOptions options;
+  get_dataset_options(dataset, options);
+  u64 text_bytes = 0;
+  CorpusStats stats;
+
+  auto start = Clock::now();
+  for (size_t r = 0; r < repeat; r++) {
+    stats += read_corpus(
+        options, [&](Span<char> text) { text_bytes += text.size(); });
+  }
+  double elapsed = seconds_since(start);
+  double mb = stats.bytes / 1048576.;
+  std::cout << "Corpus: " << mb << " MB read, "
+            << text_bytes / 1048576. << " MB of strings extracted, "
+            << stats.malformed << '/' << stats.lines << " malformed lines\n"
+            << "Ingestion time: " << elapsed << "s\n"
+            << "Throughput: " << mb / elapsed << " MB/s\n";
+  return 0;
+}
+
+static int bench_split(const SyllableTable &sy_table, size_t repeat) {
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    lines.push_back(line);
+  }
+  std::unordered_map<std::string, Syllable> map;
+  for (Syllable s = 0; s < sy_table.size(); s++) {
+    map[sy_table.spelling(s)] = s;
+  }
+
+  // Both splits append to a reused vector, so only the lookups differ
+  size_t syllables = 0, errors = 0;
+  std::vector<Syllable> result;
+  auto start = Clock::now();
+  for (size_t r = 0; r < repeat; r++) {
+    for (auto &line : lines) {
+      result.clear();
+      split_for_each(line, [&](const std::string &token) {
+        auto it = map.find(token);
+        result.push_back(it != map.end() ? it->second : INVALID_SYLLABLE);
+      });
+      syllables += result.size();
+    }
+  }
+  double map_elapsed = seconds_since(start);
+
+  start = Clock::now();
+  for (size_t r = 0; r < repeat; r++) {
+    for (auto &line : lines) {
+      result.clear();
+      if (sy_table.split(Span<char>(line.data(), line.size()), result) !=
+          SplitStatus::OK)
+        errors++;
+    }
+  }
+  double span_elapsed = seconds_since(start);
+
+  std::cout << "Syllables: " << syllables << ", errors: " << errors << '\n'
+            << "Hash map split: " << map_elapsed * 1e9 / syllables
+            << " ns/syllable\n"
+            << "Zero-copy split: " << span_elapsed * 1e9 / syllables
+            << " ns/syllable\n";
+  return 0;
+}
+
+static void set_pruning(IME &ime, double filter_threshold, int max_states) {
+  if (auto bigram = dynamic_cast<BigramIME *>(&ime)) {
+    set_pruning(bigram->options, filter_threshold, max_states);
+  } else if (auto word = dynamic_cast<WordIME *>(&ime)) {
+    set_pruning(word->options, filter_threshold, max_states);
+  } else if (auto word_tri = dynamic_cast<WordTriIME *>(&ime)) {
+    set_pruning(word_tri->options, filter_threshold, max_states);
+  }
+}
+
+struct Measurement {
+  size_t errors = 0;
+  /// Sentences equal to the answer, in the first round.
+  size_t correct = 0;
+  double elapsed;
+};
+
+static Measurement measure(const IME &ime,
+                           const std::vector<std::vector<Syllable>> &inputs,
+                           const std::vector<std::string> &answers,
+                           size_t repeat) {
+  Measurement m;
+  auto start = Clock::now();
+  for (size_t r = 0; r < repeat; r++) {
+    auto results = ime.translate_batch(inputs);
+    for (size_t i = 0; i < results.size(); i++) {
+      m.errors += !results[i].ok;
+      if (r == 0 && i < answers.size())
+        m.correct += results[i].ok && results[i].text == answers[i];
+    }
+  }
+  m.elapsed = seconds_since(start);
+  return m;
+}
+
+/**
+ * Per-character perplexity of the answers given the inputs, scoring each
+ * answer by the best path spelling it among the `k` best candidates.
+ *
+ * Answers missing from the candidates are left out; the number of the others
+ * is stored to `found`.
+ */
+static double perplexity(const IME &ime,
+                         const std::vector<std::vector<Syllable>> &inputs,
+                         const std::vector<std::string> &answers, size_t k,
+                         size_t &found) {
+  double log_prob = 0;
+  size_t chars = 0;
+  found = 0;
+  for (size_t i = 0; i < std::min(inputs.size(), answers.size()); i++) {
+    std::vector<Candidate> candidates;
+    try {
+      candidates = ime.translate_nbest(inputs[i], k);
+    } catch (const std::exception &) {
+    }
+    for (auto &candidate : candidates) {
+      if (candidate.text != answers[i])
+        continue;
+      log_prob += candidate.score;
+      for (char c : answers[i]) {
+        chars += ((u8)c & 0xc0) != 0x80;
+      }
+      found++;
+      break;
+    }
+  }
+  return std::exp(-log_prob / chars);
+}
+
+int main(int argc, char *argv[]) {
+  bool split = argc >= 2 && !strcmp(argv[1], "split");
+  if (argc < 3 && !split) {
+    std::cerr << "Usage: " << argv[0]
+              << " {char, word, word_tri, corpus} <dataset> | split"
+                 " [--repeat N]"
+                 " [--threads N] [--nbest K] [--session] [--filter T]"
+                 " [--max-states N] [--max-candidates N] [--answer FILE]"
+                 " [--sweep] [--dict FILE]\n";
+    return 1;
+  }
+
+  size_t repeat = 10, threads = 1, nbest = 0;
+  bool session = false, sweep = false;
+  double filter_threshold = NAN;
+  int max_states = -1;
+  size_t max_candidates = 0;
+  std::string answer_path, dict_path;
+  for (int i = split ? 2 : 3; i < argc; i++) {
+    if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+      repeat = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--nbest") && i + 1 < argc) {
+      nbest = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--session")) {
+      session = true;
+    } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+      filter_threshold = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--max-states") && i + 1 < argc) {
+      max_states = std::max(atoi(argv[++i]), 0);
+    } else if (!strcmp(argv[i], "--max-candidates") && i + 1 < argc) {
+      max_candidates = std::max(atoi(argv[++i]), 0);
+    } else if (!strcmp(argv[i], "--answer") && i + 1 < argc) {
+      answer_path = argv[++i];
+    } else if (!strcmp(argv[i], "--dict") && i + 1 < argc) {
+      dict_path = argv[++i];
+    } else if (!strcmp(argv[i], "--sweep")) {
+      sweep = true;
+    } else {
+      std::cerr << "Unknown option: " << argv[i] << '\n';
+      return 1;
+    }
+  }
+
+  if (!strcmp(argv[1], "corpus"))
+    return bench_corpus(argv[2], repeat);
+
+  auto sy_table = std::make_shared<SyllableTable>();
+  auto ch_table = std::make_shared<CharTable>();
+  init_tables(*sy_table, *ch_table);
+  if (split)
+    return bench_split(*sy_table, repeat);
+
+  auto start = Clock::now();
+  auto ime = load_ime(argv[1], argv[2], dict_path, sy_table, ch_table);
+  std::cerr << "Load time: " << seconds_since(start) << "s\n";
+  ime->set_threads(threads);
+  if (auto word = dynamic_cast<WordIME *>(ime.get()))
+    word->options.max_candidates = max_candidates;
+
+  std::vector<std::vector<Syllable>> inputs;
+  size_t syllable_count = 0;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    inputs.push_back(sy_table->split(line));
+    syllable_count += inputs.back().size();
+  }
+
+  std::vector<std::string> answers;
+  if (!answer_path.empty()) {
+    std::ifstream answer_file(answer_path);
+    if (!answer_file) {
+      std::cerr << "Failed to open file: " << answer_path << '\n';
+      return 1;
+    }
+    while (std::getline(answer_file, line)) {
+      answers.push_back(line);
+    }
+  }
+  size_t sentences = inputs.size() * repeat;
+  auto accuracy = [&](const Measurement &m) {
+    return 100. * m.correct / std::min(inputs.size(), answers.size());
+  };
+
+  if (sweep) {
+    for (double filter : {0., 1e-6, 1e-3, 1e-1}) {
+      for (int max : {0, 64, 16, 4}) {
+        set_pruning(*ime, filter, max);
+        auto m = measure(*ime, inputs, answers, repeat);
+        std::cout << "filter=" << filter << " max_states=" << max << ": ";
+        if (!answers.empty())
+          std::cout << "accuracy " << accuracy(m) << "%, ";
+        std::cout << sentences / m.elapsed << " sentences/s\n";
+      }
+    }
+    return 0;
+  }
+
+  set_pruning(*ime, filter_threshold, max_states);
+  auto m = measure(*ime, inputs, answers, repeat);
+  double elapsed = m.elapsed;
+  std::cout << "Sentences: " << sentences << " (" << m.errors << " failed)\n"
+            << "Translate time: " << elapsed << "s\n"
+            << "Throughput: " << sentences / elapsed << " sentences/s, "
+            << syllable_count * repeat / elapsed << " syllables/s\n"
+            << "Latency: " << elapsed / sentences * 1e6 << "us/sentence\n";
+  if (!answers.empty()) {
+    const size_t k = 64;
+    size_t found;
+    double ppl = perplexity(*ime, inputs, answers, k, found);
+    std::cout << "Accuracy: " << accuracy(m) << "%\n"
+              << "Perplexity: " << ppl << " per character (" << found << '/'
+              << std::min(inputs.size(), answers.size())
+              << " answers among the " << k << " best)\n";
+  }
+
+  // N-best decoding runs on this thread only
+  std::vector<size_t> ks;
+  for (size_t k = 1; k < nbest; k *= 2) {
+    ks.push_back(k);
+  }
+  if (nbest)
+    ks.push_back(nbest);
+  for (auto k : ks) {
+    size_t candidates = 0;
+    start = Clock::now();
+    for (size_t r = 0; r < repeat; r++) {
+      for (auto &input : inputs) {
+        try {
+          candidates += ime->translate_nbest(input, k).size();
+        } catch (const std::exception &) {
+        }
+      }
+    }
+    elapsed = seconds_since(start);
+    std::cout << "N-best k=" << k << ": " << elapsed / sentences * 1e6
+              << "us/sentence, " << (double)candidates / sentences
+              << " candidates/sentence\n";
+  }
+
+  if (session) {
+    // Type every line, reading the text after each keystroke
+    std::vector<std::vector<std::string>> typed(inputs.size());
+    start = Clock::now();
+    for (size_t i = 0; i < inputs.size(); i++) {
+      auto decoder = ime->start_session();
+      for (auto syllable : inputs[i]) {
+        decoder->push(syllable);
+        try {
+          typed[i].push_back(decoder->text());
+        } catch (const std::exception &) {
+          typed[i].push_back("");
+        }
+      }
+    }
+    double session_elapsed = seconds_since(start);
+
+    size_t mismatches = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < inputs.size(); i++) {
+      for (size_t j = 1; j <= inputs[i].size(); j++) {
+        std::vector<Syllable> prefix(inputs[i].begin(), inputs[i].begin() + j);
+        std::string text;
+        try {
+          text = ime->translate(prefix);
+        } catch (const std::exception &) {
+        }
+        mismatches += text != typed[i][j - 1];
+      }
+    }
+    double prefix_elapsed = seconds_since(start);
+
+    std::cout << "Session: " << session_elapsed / syllable_count * 1e6
+              << "us/keystroke (" << prefix_elapsed / syllable_count * 1e6
+              << "us/keystroke retranslating, " << mismatches
+              << " mismatches)\n";
+  }
+}
@@ -1,15 +1,15 @@
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 
 #include "ime/bigram.hpp"
 
+#include "encoding.hpp"
+#include "lattice.hpp"
 #include "utils.hpp"
 
-/**
- * Adds a sentence to the bigram model.
- */
-void BigramIME::add_sentence(const char *sentence, size_t len) {
+template <class F> void BigramIME::add_chars(F &&next_char) {
   Char prev = INVALID_CHAR;
   auto feed_char = [&](Char ch) {
     if (prev == ch && prev == ch_table->eos())
@@ -24,27 +24,41 @@ void BigramIME::add_sentence(const char *sentence, size_t len) {
   };
 
   feed_char(ch_table->sos());
+  Char ch;
+  while (next_char(ch)) {
+    feed_char(ch == INVALID_CHAR ? ch_table->eos() : ch);
+  }
+  feed_char(ch_table->eos());
+}
 
+/**
+ * Adds a sentence to the bigram model.
+ */
+void BigramIME::add_sentence(const char *sentence, size_t len) {
   size_t i = 0;
-  while (i < len) {
-    size_t char_length;
-    Char ch;
+  add_chars([&](Char &ch) {
+    if (i >= len)
+      return false;
     // Is two-bytes character?
     if (sentence[i] & 0x80) {
-      char_length = 2;
       ch = ch_table->get(sentence + i);
+      i += 2;
     } else {
-      char_length = 1;
       ch = INVALID_CHAR;
+      i++;
     }
-    if (ch == INVALID_CHAR) {
-      feed_char(ch_table->eos());
-    } else {
-      feed_char(ch);
-    }
-    i += char_length;
-  }
-  feed_char(ch_table->eos());
+    return true;
+  });
+}
+
+void BigramIME::add_utf8_sentence(const char *sentence, size_t len) {
+  const char *p = sentence, *end = sentence + len;
+  add_chars([&](Char &ch) {
+    if (p == end)
+      return false;
+    ch = ch_table->get_codepoint(next_utf8(p, end));
+    return true;
+  });
 }
 
 void BigramIME::build(const SyllableTable &sy_table) {
@@ -54,68 +68,211 @@ void BigramIME::build(const SyllableTable &sy_table) {
       total += unigram_freqs[ch];
     }
   }
+
+  bigram_offsets.assign(1, 0);
+  bigram_chars.clear();
+  bigram_counts.clear();
+  for (auto &row : bigram_freqs) {
+    for (Char ch = 0; ch < row.size(); ch++) {
+      if (row[ch]) {
+        assert(row[ch] <= UINT32_MAX && "Bigram count overflow");
+        bigram_chars.push_back(ch);
+        bigram_counts.push_back(row[ch]);
+      }
+    }
+    bigram_offsets.push_back(bigram_chars.size());
+    std::vector<u64>().swap(row);
+  }
+  std::vector<std::vector<u64>>().swap(bigram_freqs);
+  bigram_chars.shrink_to_fit();
+  bigram_counts.shrink_to_fit();
+
+  bigrams.offsets = bigram_offsets;
+  bigrams.keys = bigram_chars;
+  bigrams.values = bigram_counts;
+
+  prepare();
 }
 
-std::string BigramIME::translate(const std::vector<Syllable> &syllables) const {
-  struct PosState {
-    double prob;
-    Char prev;
-  };
-  std::vector<std::unordered_map<Char, PosState>> states(syllables.size() + 2);
+void BigramIME::prepare() {
+  const double lambda = options.lambda;
+  std::vector<double> prob2(ch_table->size());
+  unigram_scores.resize(ch_table->size());
+  for (Char ch = 0; ch < ch_table->size(); ch++) {
+    prob2[ch] = (double)unigram_freqs[ch] / total;
+    unigram_scores[ch] = std::log((1 - lambda) * prob2[ch]);
+  }
 
-  size_t i = 0;
-  states[0][ch_table->sos()] = {1.0, INVALID_CHAR};
-
-  auto transit = [&](const std::vector<Char> &chars) {
-    for (auto &st_pa : states[i++]) {
-      auto ch1 = st_pa.first;
-      auto prev = st_pa.second;
-
-      auto &bi_freqs = bigram_freqs[ch1];
-      for (auto ch2 : chars) {
-        u64 bi_freq = 0;
-        if (!bi_freqs.empty() && (options.use_sos || ch1 != ch_table->sos())) {
-          bi_freq = bi_freqs[ch2];
-        }
-
-        double prob1 = (double)bi_freq / unigram_freqs[ch1];
-        double prob2 = (double)unigram_freqs[ch2] / total;
-        double prob = options.lambda * prob1 + (1 - options.lambda) * prob2;
-
-        if (!options.use_eos && ch2 == ch_table->eos())
-          prob = 1.0;
-
-        auto &state = states[i][ch2];
-        if (update_max(state.prob, prev.prob * prob)) {
-          state.prev = ch1;
-        }
+  bigram_scores.resize(bigram_chars.size());
+  for (Char ch1 = 0; ch1 < bigrams.rows(); ch1++) {
+    for (u64 k = bigram_offsets[ch1]; k < bigram_offsets[ch1 + 1]; k++) {
+      double prob1 = (double)bigram_counts[k] / unigram_freqs[ch1];
+      bigram_scores[k] =
+          std::log(lambda * prob1 + (1 - lambda) * prob2[bigram_chars[k]]);
+    }
+  }
+  prepared_lambda = lambda;
+}
+
+void BigramIME::start(Lattice<Char> &lattice) const {
+  assert(options.lambda == prepared_lambda &&
+         "Call prepare() after changing options");
+  lattice.add(ch_table->sos(), 0.);
+  lattice.next_position();
+}
+
+float BigramIME::edge_score(Char ch1, Char ch2, bool use_bigram) const {
+  if (!options.use_eos && ch2 == ch_table->eos())
+    return 0.;
+  u64 index = use_bigram ? bigrams.find(ch1, ch2) : INVALID_INDEX;
+  return index == INVALID_INDEX ? unigram_scores[ch2] : bigram_scores[index];
+}
+
+void BigramIME::gather_edges(Char ch1, Syllable syllable, bool use_bigram,
+                             float *edges) const {
+  auto &chars = ch_table->chars(syllable);
+  for (size_t k = 0; k < chars.size(); k++) {
+    edges[k] = unigram_scores[chars[k]];
+  }
+  if (!use_bigram)
+    return;
+
+  // Merge the successors of `ch1` with the characters, both sorted by index
+  auto successors = bigrams.row_keys(ch1);
+  const Char *p = successors.begin(), *end = successors.end();
+  auto &sorted = ch_table->sorted_chars(syllable);
+  auto &ranks = ch_table->sorted_ranks(syllable);
+  for (size_t i = 0; i < sorted.size() && p < end; i++) {
+    p = gallop(p, end, sorted[i]);
+    if (p < end && *p == sorted[i])
+      edges[ranks[i]] = bigram_scores[p - bigram_chars.data()];
+  }
+}
+
+void BigramIME::extend(Lattice<Char> &lattice, const std::vector<Char> &chars,
+                       Syllable syllable) const {
+  u32 prev_begin = lattice.begin(lattice.positions() - 1);
+  u32 prev_end = lattice.end(lattice.positions() - 1);
+  u32 begin = lattice.size();
+  for (auto ch : chars) {
+    lattice.add(ch);
+  }
+  lattice.next_position();
+
+  // Score all candidates of a predecessor, then relax them in one batch
+  static thread_local std::vector<float> edges;
+  edges.resize(chars.size());
+  for (u32 p = prev_begin; p < prev_end; p++) {
+    u32 first = lattice.hyp(p), last = lattice.hyp(p + 1);
+    if (lattice.scores[first] == -INFINITY)
+      continue;
+    auto ch1 = lattice.keys[p];
+    bool use_bigram = options.use_sos || ch1 != ch_table->sos();
+    if (syllable != INVALID_SYLLABLE) {
+      gather_edges(ch1, syllable, use_bigram, edges.data());
+    } else {
+      for (u32 k = 0; k < chars.size(); k++) {
+        edges[k] = edge_score(ch1, chars[k], use_bigram);
       }
     }
-  };
 
+    if (lattice.hyp_width() == 1) {
+      lattice.offer_all(begin, edges.data(), chars.size(), p);
+      continue;
+    }
+    for (u32 k = 0; k < chars.size(); k++) {
+      for (u32 h = first; h < last && lattice.scores[h] != -INFINITY; h++) {
+        lattice.offer(begin + k, lattice.scores[h] + edges[k], h);
+      }
+    }
+  }
+
+  if (options.filter_threshold > 0 || options.max_states) {
+    lattice.prune(lattice.positions() - 1, std::log(options.filter_threshold),
+                  options.max_states);
+  }
+}
+
+const Lattice<Char> &
+BigramIME::decode(const std::vector<Syllable> &syllables, u32 width) const {
+  assert(width > 0 && "At least one hypothesis must be kept");
+  auto &lattice = scratch_lattice<Char>(width);
+  start(lattice);
   for (size_t i = 0; i < syllables.size(); i++) {
-    transit(ch_table->chars(syllables[i]));
+    extend(lattice, ch_table->chars(syllables[i]), syllables[i]);
   }
-  transit({ch_table->eos()});
+  extend(lattice, {ch_table->eos()});
 
-  if (states[i].empty()) {
+  if (lattice.scores[lattice.hyp(lattice.size() - 1)] == -INFINITY) {
     throw std::runtime_error("No valid path found");
   }
+  return lattice;
+}
 
-  Char ch = ch_table->eos();
-  std::vector<Char> result;
-  while (true) {
-    ch = states[i][ch].prev;
-    if (i-- == 0) {
+std::string BigramIME::spell(const Lattice<Char> &lattice, u32 hyp) const {
+  auto slots = lattice.path(hyp);
+  std::string result;
+  // Skip <s> and </s>
+  for (size_t i = 1; i + 1 < slots.size(); i++) {
+    result += ch_table->utf8_char(lattice.keys[slots[i]]);
+  }
+  return result;
+}
+
+std::string BigramIME::translate(const std::vector<Syllable> &syllables) const {
+  auto &lattice = decode(syllables, 1);
+  return spell(lattice, lattice.hyp(lattice.size() - 1));
+}
+
+std::vector<Candidate>
+BigramIME::translate_nbest(const std::vector<Syllable> &syllables,
+                           size_t k) const {
+  if (k == 0)
+    return {};
+  auto &lattice = decode(syllables, k);
+  std::vector<Candidate> candidates;
+  u32 last = lattice.size() - 1;
+  for (u32 r = 0; r < k; r++) {
+    u32 h = lattice.hyp(last, r);
+    if (lattice.scores[h] == -INFINITY)
       break;
-    }
-    result.push_back(ch);
+    push_candidate(candidates, spell(lattice, h), lattice.scores[h]);
   }
-  result.pop_back();
+  return candidates;
+}
+
+class BigramIME::Session : public DecodeSession {
+public:
+  explicit Session(const BigramIME &ime) : ime(ime) { ime.start(lattice); }
 
-  std::string result_str;
-  for (auto it = result.rbegin(); it != result.rend(); it++) {
-    result_str += ch_table->utf8_char(*it);
+  void push(Syllable syllable) override {
+    ime.extend(lattice, ime.ch_table->chars(syllable), syllable);
   }
-  return result_str;
+
+  void pop() override {
+    assert(size() > 0 && "No syllable to remove");
+    lattice.truncate(lattice.positions() - 1);
+  }
+
+  size_t size() const override { return lattice.positions() - 1; }
+
+  std::string text() override {
+    ime.extend(lattice, {ime.ch_table->eos()});
+    u32 hyp = lattice.hyp(lattice.size() - 1);
+    bool found = lattice.scores[hyp] != -INFINITY;
+    auto result = found ? ime.spell(lattice, hyp) : std::string();
+    lattice.truncate(lattice.positions() - 1);
+    if (!found) {
+      throw std::runtime_error("No valid path found");
+    }
+    return result;
+  }
+
+private:
+  const BigramIME &ime;
+  Lattice<Char> lattice;
+};
+
+std::unique_ptr<DecodeSession> BigramIME::start_session() const {
+  return std::unique_ptr<DecodeSession>(new Session(*this));
 }
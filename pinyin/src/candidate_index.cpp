@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cassert>
+
+#include "candidate_index.hpp"
+
+void CandidateIndex::add(Span<Syllable> pinyin, Word word, u64 freq) {
+  assert(!pinyin.empty() && "Empty pinyin");
+  entries.push_back({(u32)pending_syllables.size(), (u32)pinyin.size(), word,
+                     freq});
+  pending_syllables.insert(pending_syllables.end(), pinyin.begin(),
+                           pinyin.end());
+}
+
+void CandidateIndex::build() {
+  auto pinyin = [&](const Entry &e) {
+    return Span<Syllable>(pending_syllables.data() + e.offset, e.length);
+  };
+  // Order by bucket, then remaining syllables, then descending frequency
+  std::sort(entries.begin(), entries.end(),
+            [&](const Entry &a, const Entry &b) {
+              auto pa = pinyin(a), pb = pinyin(b);
+              if (pa[0] != pb[0])
+                return pa[0] < pb[0];
+              if (pa.size() != pb.size())
+                return pa.size() < pb.size();
+              if (!std::equal(pa.begin(), pa.end(), pb.begin()))
+                return std::lexicographical_compare(pa.begin(), pa.end(),
+                                                    pb.begin(), pb.end());
+              if (a.freq != b.freq)
+                return a.freq > b.freq;
+              return a.word < b.word;
+            });
+
+  max_len = 0;
+  syllable_bound = 0;
+  for (auto &e : entries) {
+    max_len = std::max<size_t>(max_len, e.length);
+    syllable_bound = std::max<size_t>(syllable_bound, pinyin(e)[0] + 1);
+  }
+
+  std::vector<u32> bucket_sizes(syllable_bound * max_len, 0);
+  rest_offsets.clear();
+  rests.clear();
+  group_offsets.assign(1, 0);
+  words.clear();
+  freqs.clear();
+  for (size_t i = 0; i < entries.size(); i++) {
+    auto p = pinyin(entries[i]);
+    if (!i || p.size() != entries[i - 1].length ||
+        !std::equal(p.begin(), p.end(), pinyin(entries[i - 1]).begin())) {
+      if (i)
+        group_offsets.push_back(words.size());
+      bucket_sizes[p[0] * max_len + p.size() - 1]++;
+      rest_offsets.push_back(rests.size());
+      rests.insert(rests.end(), p.begin() + 1, p.end());
+      freqs.push_back(0);
+    }
+    words.push_back(entries[i].word);
+    freqs.back() += entries[i].freq;
+  }
+  if (!entries.empty())
+    group_offsets.push_back(words.size());
+
+  sorted_words.resize(words.size());
+  ranks.resize(words.size());
+  for (size_t g = 0; g < groups(); g++) {
+    u32 first = group_offsets[g], last = group_offsets[g + 1];
+    for (u32 k = first; k < last; k++) {
+      ranks[k] = k - first;
+    }
+    std::sort(ranks.begin() + first, ranks.begin() + last, [&](u32 a, u32 b) {
+      return words[first + a] < words[first + b];
+    });
+    for (u32 k = first; k < last; k++) {
+      sorted_words[k] = words[first + ranks[k]];
+    }
+  }
+
+  bucket_offsets.assign(1, 0);
+  for (auto size : bucket_sizes) {
+    bucket_offsets.push_back(bucket_offsets.back() + size);
+  }
+
+  std::vector<Entry>().swap(entries);
+  std::vector<Syllable>().swap(pending_syllables);
+}
+
+const size_t CandidateIndex::NO_GROUP;
+
+size_t CandidateIndex::find_group(Span<Syllable> pinyin) const {
+  if (pinyin.empty() || pinyin.size() > max_len || pinyin[0] >= syllable_bound)
+    return NO_GROUP;
+  size_t bucket = pinyin[0] * max_len + pinyin.size() - 1;
+  u32 lo = bucket_offsets[bucket], hi = bucket_offsets[bucket + 1];
+  auto key = pinyin.begin() + 1;
+  size_t rest = pinyin.size() - 1;
+  while (lo < hi) {
+    u32 mid = lo + (hi - lo) / 2;
+    const Syllable *candidate = rests.data() + rest_offsets[mid];
+    if (std::lexicographical_compare(candidate, candidate + rest, key,
+                                     pinyin.end())) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == bucket_offsets[bucket + 1] ||
+      !std::equal(key, pinyin.end(), rests.data() + rest_offsets[lo]))
+    return NO_GROUP;
+  return lo;
+}
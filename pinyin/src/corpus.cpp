@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "corpus.hpp"
 #include "utils.hpp"
 
@@ -11,17 +13,47 @@ void init_tables(SyllableTable &sy_table, CharTable &ch_table) {
       ch_table.insert(syllable, ch_table.insert(ch.data()));
     });
   });
+  sy_table.build();
+}
+
+void load_words(const SyllableTable &sy_table, WordTable &word_table,
+                const char *path) {
+  std::vector<Syllable> pinyin;
+  read_lines(path, [&](const std::string &line) {
+    if (line == "<s>" || line == "</s>")
+      return;
+    auto index = std::min(line.find(' '), line.size());
+    pinyin.clear();
+    if (index < line.size()) {
+      Span<char> seq(line.data() + index + 1, line.size() - index - 1), error;
+      if (sy_table.split(seq, pinyin, &error) != SplitStatus::OK) {
+        throw std::runtime_error("Invalid syllable: " +
+                                 std::string(error.begin(), error.end()));
+      }
+    }
+    word_table.insert(Span<char>(line.data(), index), pinyin);
+  });
+}
+
+bool load_dict_words(const SyllableTable &sy_table, WordTable &word_table,
+                     const std::string &prefix) {
+  auto image_path = prefix + ".table";
+  if (std::ifstream(image_path)) {
+    word_table.load(image_path.data());
+    return true;
+  }
+  auto words_path = prefix + ".txt";
+  if (!std::ifstream(words_path))
+    return false;
+  load_words(sy_table, word_table, words_path.data());
+  return true;
 }
 
-std::pair<size_t, size_t> extract_slice(const std::string &str,
-                                        const char *start, const char *end,
-                                        size_t start_idx) {
-  start_idx = str.find(start, start_idx);
-  assert(start_idx != std::string::npos);
-  start_idx += strlen(start);
-  auto end_idx = str.find(end, start_idx);
-  assert(end_idx != std::string::npos);
-  return std::make_pair(start_idx, end_idx);
+void report_corpus_stats(const CorpusStats &stats, double seconds) {
+  double mb = stats.bytes / 1048576.;
+  std::cerr << "Read " << mb << " MB of corpus in " << seconds << "s ("
+            << mb / seconds << " MB/s), skipped " << stats.malformed << '/'
+            << stats.lines << " malformed lines\n";
 }
 
 void get_dataset_options(const std::string &dataset, CorpusOptions &options) {
@@ -42,3 +74,30 @@ void get_dataset_options(const std::string &dataset, CorpusOptions &options) {
     throw std::runtime_error("Unknown dataset: " + dataset);
   }
 }
+
+std::vector<CorpusShard> split_corpus(const CorpusOptions &options,
+                                      size_t count) {
+  std::vector<std::pair<std::string, u64>> files;
+  u64 total = 0;
+  for (auto *corpus : options.corpus_list) {
+    std::string path(options.corpus_dir);
+    path += corpus;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+      throw std::runtime_error("Failed to open file");
+    }
+    u64 size = file.tellg();
+    files.emplace_back(path, size);
+    total += size;
+  }
+
+  const u64 shard_size = std::max<u64>(total / std::max<size_t>(count, 1), 1);
+  std::vector<CorpusShard> shards;
+  for (auto &file : files) {
+    for (u64 begin = 0; begin < file.second; begin += shard_size) {
+      shards.push_back(
+          {file.first, begin, std::min(begin + shard_size, file.second)});
+    }
+  }
+  return shards;
+}
@@ -1,29 +1,197 @@
+#include <cstring>
+#include <iconv.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "encoding.hpp"
 
-std::string iconv_convert(iconv_t ic, const char *start, size_t len,
-                          size_t outlen) {
-  std::string result;
-  result.resize(outlen);
+namespace {
+
+/// UTF-8 encoding of a GBK character.
+struct Utf8Char {
+  char bytes[3];
+  /// 0 if the character is invalid.
+  u8 size;
+};
+
+/**
+ * Lookup tables between GBK and Unicode.
+ *
+ * Double-byte characters are indexed as in `gbk_index`, and non-ASCII single
+ * bytes (only 0x80, the euro sign) by their value. Code points map to the GBK
+ * bytes `lead << 8 | trail`, or to a single byte, or 0. Since GBK only covers
+ * the BMP, all tables are direct-mapped.
+ */
+struct GbkTables {
+  Utf8Char to_utf8[GBK_CHAR_COUNT];
+  Utf8Char single_to_utf8[0x80];
+  u16 to_gbk[0x10000];
+
+  GbkTables();
+
+private:
+  /// Converts `gbk` with iconv, recording it in the tables if valid.
+  void add(iconv_t ic, const char *gbk, size_t len, Utf8Char &ch);
+};
+
+} // namespace
+
+/**
+ * Index of a GBK double-byte character, or `GBK_CHAR_COUNT` if the bytes are
+ * not a valid lead and trail.
+ */
+static size_t gbk_index(u8 lead, u8 trail) {
+  if (lead < 0x81 || lead == 0xff || trail < 0x40 || trail == 0x7f ||
+      trail == 0xff)
+    return GBK_CHAR_COUNT;
+  return (lead - 0x81) * (0xfe - 0x40) + trail - 0x40 - (trail > 0x7f);
+}
 
-  char *inbuf = const_cast<char *>(start);
-  size_t inbytesleft = len;
-  char *outbuf = const_cast<char *>(result.data());
-  size_t outbytesleft = result.size();
-  iconv(ic, &inbuf, &inbytesleft, &outbuf, &outbytesleft);
-  result.resize(result.size() - outbytesleft);
-  return result;
+GbkTables::GbkTables() : to_utf8(), single_to_utf8(), to_gbk() {
+  iconv_t ic = iconv_open("UTF-8", "GBK");
+  for (u32 lead = 0x81; lead < 0xff; lead++) {
+    for (u32 trail = 0x40; trail < 0xff; trail++) {
+      size_t index = gbk_index(lead, trail);
+      if (index == GBK_CHAR_COUNT)
+        continue;
+      char gbk[2] = {(char)lead, (char)trail};
+      add(ic, gbk, 2, to_utf8[index]);
+    }
+  }
+  for (u32 byte = 0x80; byte < 0x100; byte++) {
+    char gbk = byte;
+    add(ic, &gbk, 1, single_to_utf8[byte - 0x80]);
+  }
+  iconv_close(ic);
 }
 
+void GbkTables::add(iconv_t ic, const char *gbk, size_t len, Utf8Char &ch) {
+  char utf8[4];
+  char *inbuf = const_cast<char *>(gbk), *outbuf = utf8;
+  size_t inbytesleft = len, outbytesleft = sizeof(utf8);
+  size_t result = iconv(ic, &inbuf, &inbytesleft, &outbuf, &outbytesleft);
+  // Reset the state after an incomplete sequence
+  iconv(ic, nullptr, nullptr, nullptr, nullptr);
+  if (result == (size_t)-1 || outbuf - utf8 > 3)
+    return;
 
-bool is_chinese(iconv_t ic, const CharTable &ch_table, const std::string &str) {
-  auto gbk = utf8_to_gbk(ic, str.data(), str.size());
-  if (gbk.size() & 1)
-    return false;
-  for (size_t i = 0; i < gbk.size(); i += 2) {
-    if ((gbk[i] & 0x80) == 0)
-      return false;
-    if (ch_table.get(gbk.data() + i) == INVALID_CHAR)
+  ch.size = outbuf - utf8;
+  memcpy(ch.bytes, utf8, ch.size);
+  const char *p = utf8;
+  u32 codepoint = next_utf8(p, outbuf);
+  if (codepoint >= 0x80 && codepoint < 0x10000 && !to_gbk[codepoint])
+    to_gbk[codepoint] = len == 2 ? (u8)gbk[0] << 8 | (u8)gbk[1] : (u8)gbk[0];
+}
+
+static const GbkTables &gbk_tables() {
+  static const GbkTables tables;
+  return tables;
+}
+
+/**
+ * Copies a run of ASCII bytes from `p` to `out`, advancing both.
+ *
+ * Whole blocks of 16 bytes are stored, so `out` must have room for 16 bytes
+ * as long as 16 bytes of input are left.
+ */
+static void copy_ascii(const char *&p, const char *end, char *&out) {
+#ifdef __SSE2__
+  while (end - p >= 16) {
+    auto chunk = _mm_loadu_si128((const __m128i *)p);
+    _mm_storeu_si128((__m128i *)out, chunk);
+    if (u32 mask = _mm_movemask_epi8(chunk)) {
+      p += __builtin_ctz(mask);
+      out += __builtin_ctz(mask);
+      return;
+    }
+    p += 16;
+    out += 16;
+  }
+#endif
+  while (p < end && (u8)*p < 0x80)
+    *out++ = *p++;
+}
+
+void append_utf8(std::string &out, u32 codepoint) {
+  if (codepoint < 0x80) {
+    out += (char)codepoint;
+  } else if (codepoint < 0x800) {
+    out += (char)(0xc0 | codepoint >> 6);
+    out += (char)(0x80 | (codepoint & 0x3f));
+  } else if (codepoint < 0x10000) {
+    out += (char)(0xe0 | codepoint >> 12);
+    out += (char)(0x80 | (codepoint >> 6 & 0x3f));
+    out += (char)(0x80 | (codepoint & 0x3f));
+  } else {
+    out += (char)(0xf0 | codepoint >> 18);
+    out += (char)(0x80 | (codepoint >> 12 & 0x3f));
+    out += (char)(0x80 | (codepoint >> 6 & 0x3f));
+    out += (char)(0x80 | (codepoint & 0x3f));
+  }
+}
+
+void gbk_to_utf8(const char *start, size_t len, std::string &out) {
+  auto &tables = gbk_tables();
+  size_t size = out.size();
+  // Each byte takes at most 1.5 bytes in UTF-8
+  out.resize(size + len + len / 2);
+  char *dst = &out[size];
+  const char *p = start, *end = start + len;
+  while (p < end) {
+    if ((u8)*p < 0x80) {
+      copy_ascii(p, end, dst);
+      continue;
+    }
+    const Utf8Char *ch = &tables.single_to_utf8[(u8)*p - 0x80];
+    if (ch->size) {
+      // Make room for a single byte taking 3 bytes in UTF-8
+      size_t offset = dst - out.data();
+      out.resize(out.size() + 2);
+      dst = &out[offset];
+      p++;
+    } else {
+      if (end - p < 2)
+        break;
+      size_t index = gbk_index(p[0], p[1]);
+      if (index == GBK_CHAR_COUNT || !tables.to_utf8[index].size)
+        break;
+      ch = &tables.to_utf8[index];
+      p += 2;
+    }
+    memcpy(dst, ch->bytes, sizeof(ch->bytes));
+    dst += ch->size;
+  }
+  out.resize(dst - out.data());
+}
+
+void utf8_to_gbk(const char *start, size_t len, std::string &out) {
+  size_t size = out.size();
+  // No character takes more bytes in GBK
+  out.resize(size + len);
+  char *dst = &out[size];
+  const char *p = start, *end = start + len;
+  while (p < end) {
+    if ((u8)*p < 0x80) {
+      copy_ascii(p, end, dst);
+      continue;
+    }
+    u32 codepoint = next_utf8(p, end);
+    u16 code = codepoint < 0x10000 ? gbk_tables().to_gbk[codepoint] : 0;
+    if (!code)
+      break;
+    if (code >= 0x100)
+      *dst++ = code >> 8;
+    *dst++ = code;
+  }
+  out.resize(dst - out.data());
+}
+
+bool is_chinese(const CharTable &ch_table, const std::string &str) {
+  const char *p = str.data(), *end = p + str.size();
+  while (p < end) {
+    if (ch_table.get_codepoint(next_utf8(p, end)) == INVALID_CHAR)
       return false;
   }
   return true;
-}
\ No newline at end of file
+}
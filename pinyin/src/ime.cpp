@@ -0,0 +1,95 @@
+#include "ime/ime.hpp"
+
+void IME::set_threads(size_t threads) {
+  if (threads <= 1) {
+    pool.reset();
+  } else if (!pool || pool->size() != threads) {
+    pool.reset(new ThreadPool(threads));
+  }
+}
+
+void IME::push_candidate(std::vector<Candidate> &candidates, std::string text,
+                         double score) {
+  for (auto &candidate : candidates) {
+    if (candidate.text == text)
+      return;
+  }
+  candidates.push_back({std::move(text), score});
+}
+
+std::vector<TranslateResult>
+IME::translate_batch(const std::vector<std::vector<Syllable>> &inputs) const {
+  std::vector<TranslateResult> results(inputs.size());
+  auto run = [&](size_t i) {
+    try {
+      results[i] = {true, translate(inputs[i])};
+    } catch (const std::exception &e) {
+      results[i] = {false, e.what()};
+    }
+  };
+  if (pool) {
+    pool->parallel_for(inputs.size(), run);
+  } else {
+    for (size_t i = 0; i < inputs.size(); i++) {
+      run(i);
+    }
+  }
+  return results;
+}
+
+/**
+ * Splits `line` into `out`, reporting an invalid syllable to stderr.
+ *
+ * Returns whether all syllables are valid.
+ */
+static bool split_line(const SyllableTable &sy_table, const std::string &line,
+                       std::vector<Syllable> &out) {
+  Span<char> error;
+  if (sy_table.split(Span<char>(line.data(), line.size()), out, &error) ==
+      SplitStatus::OK)
+    return true;
+  std::cerr << "Error: Invalid syllable: "
+            << std::string(error.begin(), error.end()) << '\n';
+  return false;
+}
+
+void translate_lines(const IME &ime, const SyllableTable &sy_table,
+                     std::istream &in, std::ostream &out) {
+  const size_t BATCH_SIZE = 4096;
+
+  std::vector<std::vector<Syllable>> inputs;
+  auto flush = [&]() {
+    for (auto &result : ime.translate_batch(inputs)) {
+      if (result.ok) {
+        out << result.text << '\n';
+      } else {
+        std::cerr << "Error: " << result.text << '\n';
+      }
+    }
+    inputs.clear();
+  };
+
+  std::string line;
+  while (std::getline(in, line)) {
+    inputs.emplace_back();
+    if (!split_line(sy_table, line, inputs.back())) {
+      inputs.pop_back();
+      continue;
+    }
+    if (inputs.size() == BATCH_SIZE)
+      flush();
+  }
+  flush();
+}
+
+std::vector<std::vector<Syllable>>
+read_syllable_lines(const SyllableTable &sy_table, std::istream &in) {
+  std::vector<std::vector<Syllable>> inputs;
+  std::string line;
+  while (std::getline(in, line)) {
+    inputs.emplace_back();
+    if (!split_line(sy_table, line, inputs.back()))
+      inputs.pop_back();
+  }
+  return inputs;
+}
@@ -0,0 +1,269 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN
+#endif
+
+#include "json.hpp"
+
+#ifdef HAVE_AVX2_SCAN
+
+static bool cpu_has_avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static const bool HAS_AVX2 = cpu_has_avx2();
+
+/**
+ * Skips the 64-byte blocks of `[p, end)` without a quote, backslash or line
+ * break. Returns the first such byte, or the start of the remaining bytes.
+ */
+__attribute__((target("avx2"))) static const char *
+skip_string_blocks(const char *p, const char *end) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  for (; end - p >= 64; p += 64) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i lo_stops = _mm256_or_si256(_mm256_cmpeq_epi8(lo, quote),
+                                       _mm256_cmpeq_epi8(lo, backslash));
+    __m256i hi_stops = _mm256_or_si256(_mm256_cmpeq_epi8(hi, quote),
+                                       _mm256_cmpeq_epi8(hi, backslash));
+    lo_stops = _mm256_or_si256(lo_stops, _mm256_cmpeq_epi8(lo, newline));
+    hi_stops = _mm256_or_si256(hi_stops, _mm256_cmpeq_epi8(hi, newline));
+    u64 mask = (u32)_mm256_movemask_epi8(lo_stops) |
+               (u64)(u32)_mm256_movemask_epi8(hi_stops) << 32;
+    if (mask)
+      return p + __builtin_ctzll(mask);
+  }
+  return p;
+}
+
+#endif
+
+/**
+ * Finds the first quote, backslash or line break of `[p, end)`, or returns
+ * `end`.
+ *
+ * Bytes from `begin` on may be read, which lets the last partial block be
+ * loaded as the last 16 bytes before `end`.
+ */
+static const char *find_string_stop(const char *begin, const char *p,
+                                    const char *end) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i newline = _mm_set1_epi8('\n');
+  auto match = [&](const char *block) -> u32 {
+    auto chunk = _mm_loadu_si128((const __m128i *)block);
+    auto stops = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                              _mm_cmpeq_epi8(chunk, backslash));
+    stops = _mm_or_si128(stops, _mm_cmpeq_epi8(chunk, newline));
+    return _mm_movemask_epi8(stops);
+  };
+#ifdef HAVE_AVX2_SCAN
+  // Keys and most values end within 32 bytes; longer strings (e.g. article
+  // bodies) are skipped 64 bytes at a time
+  if (HAS_AVX2 && end - p >= 96) {
+    if (u32 mask = match(p) | match(p + 16) << 16)
+      return p + __builtin_ctz(mask);
+    p = skip_string_blocks(p + 32, end);
+    if (end - p >= 64)
+      return p;
+  }
+#endif
+  for (; end - p >= 32; p += 32) {
+    u32 mask = match(p) | match(p + 16) << 16;
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  for (; end - p >= 16; p += 16) {
+    if (u32 mask = match(p))
+      return p + __builtin_ctz(mask);
+  }
+  if (p < end && end - begin >= 16) {
+    u32 mask = match(end - 16) >> (16 - (end - p));
+    return mask ? p + __builtin_ctz(mask) : end;
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == '"' || *p == '\\' || *p == '\n')
+      return p;
+  }
+  return end;
+}
+
+/**
+ * Whether `q` is the second byte of a GBK double-byte character, `p` being
+ * the start of a character.
+ */
+static bool is_gbk_trail(const char *p, const char *q) {
+  while (p < q) {
+    p += (u8)*p >= 0x81 ? 2 : 1;
+  }
+  return p > q;
+}
+
+/// Characters of numbers and literals; `isalnum` would look up the locale.
+static bool is_literal_char(char c) {
+  return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ||
+         c == '-' || c == '+' || c == '.';
+}
+
+/// Whitespace within a line; line breaks end the line instead.
+static bool is_json_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+JsonFieldExtractor::JsonFieldExtractor(const std::vector<const char *> &keys,
+                                       bool gbk)
+    : keys(keys.begin(), keys.end()), fields(keys.size()), gbk(gbk) {}
+
+const char *JsonFieldExtractor::scan_string(const char *p, const char *end,
+                                            bool &escaped) const {
+  escaped = false;
+  while (true) {
+    const char *q = find_string_stop(line_begin, p, end);
+    if (q == end || *q == '\n')
+      return nullptr;
+    if (*q == '"')
+      return q;
+    // A quote is never part of a GBK character, but a backslash may be
+    if (gbk && is_gbk_trail(p, q)) {
+      p = q + 1;
+      continue;
+    }
+    if (end - q < 2)
+      return nullptr;
+    escaped = true;
+    p = q + 2;
+  }
+}
+
+const char *JsonFieldExtractor::skip_value(const char *p,
+                                           const char *end) const {
+  if (*p == '{' || *p == '[') {
+    size_t depth = 0;
+    for (; p < end && *p != '\n'; p++) {
+      if (*p == '"') {
+        bool escaped;
+        p = scan_string(p + 1, end, escaped);
+        if (!p)
+          return nullptr;
+      } else if (*p == '{' || *p == '[') {
+        depth++;
+      } else if ((*p == '}' || *p == ']') && --depth == 0) {
+        return p + 1;
+      }
+    }
+    return nullptr;
+  }
+
+  // Numbers and literals
+  const char *start = p;
+  while (p < end && is_literal_char(*p))
+    p++;
+  return p > start ? p : nullptr;
+}
+
+bool JsonFieldExtractor::parse(Span<char> line) {
+  return parse_object(line.begin(), line.end()) == line.end();
+}
+
+JsonFieldExtractor::LineStatus
+JsonFieldExtractor::parse_line(const char *begin, const char *end,
+                               const char *&next) {
+  const char *p = begin;
+  while (p < end && is_json_space(*p))
+    p++;
+  LineStatus status = LineStatus::MALFORMED;
+  if (p == end || *p == '\n') {
+    status = LineStatus::EMPTY;
+  } else {
+    p = parse_object(begin, end);
+    if (p && (p == end || *p == '\n')) {
+      status = LineStatus::OK;
+    } else {
+      p = (const char *)memchr(begin, '\n', end - begin);
+      if (!p)
+        p = end;
+    }
+  }
+  next = p == end ? end : p + 1;
+  return status;
+}
+
+const char *JsonFieldExtractor::parse_object(const char *p,
+                                             const char *end) {
+  for (auto &field : fields) {
+    field.found = false;
+  }
+  line_begin = p;
+  auto skip_space = [&]() {
+    while (p < end && is_json_space(*p))
+      p++;
+  };
+
+  skip_space();
+  if (p == end || *p != '{')
+    return nullptr;
+  p++;
+  skip_space();
+  if (p < end && *p == '}') {
+    p++;
+  } else {
+    while (true) {
+      if (p == end || *p != '"')
+        return nullptr;
+      bool escaped;
+      const char *key_end = scan_string(p + 1, end, escaped);
+      if (!key_end)
+        return nullptr;
+      Span<char> key(p + 1, key_end - p - 1);
+      p = key_end + 1;
+      skip_space();
+      if (p == end || *p != ':')
+        return nullptr;
+      p++;
+      skip_space();
+      if (p == end)
+        return nullptr;
+
+      if (*p == '"') {
+        const char *value_end = scan_string(p + 1, end, escaped);
+        if (!value_end)
+          return nullptr;
+        for (size_t i = 0; i < keys.size(); i++) {
+          if (key.size() == keys[i].size() &&
+              !memcmp(key.data(), keys[i].data(), key.size())) {
+            fields[i] = {true, escaped, Span<char>(p + 1, value_end - p - 1)};
+            break;
+          }
+        }
+        p = value_end + 1;
+      } else {
+        p = skip_value(p, end);
+        if (!p)
+          return nullptr;
+      }
+
+      skip_space();
+      if (p == end)
+        return nullptr;
+      if (*p == '}') {
+        p++;
+        break;
+      }
+      if (*p != ',')
+        return nullptr;
+      p++;
+      skip_space();
+    }
+  }
+  skip_space();
+  return p;
+}
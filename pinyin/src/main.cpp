@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -10,76 +13,77 @@
 #include "corpus.hpp"
 #include "tables.hpp"
 
-int main() {
+int main(int argc, char *argv[]) {
 #ifdef ONLINE_JUDGE
   std::ios::sync_with_stdio(false);
   std::cin.tie(nullptr);
 #endif
 
+  size_t threads = 1;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(atoi(argv[++i]), 1);
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--threads N]\n";
+      return 1;
+    }
+  }
+
   auto sy_table = std::make_shared<SyllableTable>();
   auto ch_table = std::make_shared<CharTable>();
   init_tables(*sy_table, *ch_table);
 
-  clock_t start = clock();
+  auto start = std::chrono::steady_clock::now();
 
   BigramIME ime(ch_table);
   CorpusOptions options;
   get_dataset_options("sina", options);
-  // We handles UTF-8 in `add_sentence`
-  options.utf8 = true;
-  read_corpus(options, [&](const std::string &text) {
-    ime.add_sentence(text.data(), text.size());
+  // Strings are counted in the encoding of the corpus, without transcoding
+  options.raw = true;
+  read_corpus(options, [&](Span<char> text) {
+    if (options.utf8) {
+      ime.add_utf8_sentence(text.data(), text.size());
+    } else {
+      ime.add_sentence(text.data(), text.size());
+    }
   });
 
   ime.build(*sy_table);
   // ime.options.use_sos = false;
   // ime.options.use_eos = false;
 
-  clock_t end = clock();
-  std::cerr << "Build time: " << (end - start) / (double)CLOCKS_PER_SEC
-            << "s\n";
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Build time: " << elapsed.count() << "s\n";
 
   ime.options.lambda = 0.95;
+  ime.prepare();
+
+  ime.set_threads(threads);
 
 #ifndef GRID_SEARCH
-  start = clock();
-
-  std::string line;
-  while (std::getline(std::cin, line)) {
-    auto syllables = sy_table->split(line);
-    try {
-      auto result = ime.translate(syllables);
-      std::cout << result << '\n';
-    } catch (const std::exception &e) {
-      std::cerr << "Error: " << e.what() << '\n';
-    }
-  }
+  start = std::chrono::steady_clock::now();
 
-  end = clock();
-  std::cerr << "Translate time: " << (end - start) / (double)CLOCKS_PER_SEC
-            << "s\n";
-#else
+  translate_lines(ime, *sy_table, std::cin, std::cout);
 
-  std::vector<std::vector<Syllable>> inputs;
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cerr << "Translate time: " << elapsed.count() << "s\n";
+#else
 
-  std::string line;
-  while (std::getline(std::cin, line)) {
-    auto syllables = sy_table->split(line);
-    inputs.push_back(syllables);
-  }
+  auto inputs = read_syllable_lines(*sy_table, std::cin);
 
   for (int i = 1; i < 100; i++) {
     ime.options.lambda = i / 100.;
+    ime.prepare();
     std::stringstream ss;
     ss << "outputs0/output_" << i << ".txt";
     std::cerr << ss.str() << '\n';
     std::ofstream out(ss.str());
-    for (auto &syllables : inputs) {
-      try {
-        auto result = ime.translate(syllables);
-        out << result << '\n';
-      } catch (const std::exception &e) {
-        std::cerr << "Error: " << e.what() << '\n';
+    for (auto &result : ime.translate_batch(inputs)) {
+      if (result.ok) {
+        out << result.text << '\n';
+      } else {
+        std::cerr << "Error: " << result.text << '\n';
       }
     }
   }
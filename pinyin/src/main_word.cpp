@@ -1,8 +1,11 @@
 
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <numeric>
+#include <thread>
 #include <unordered_set>
 
 #include "cppjieba/MixSegment.hpp"
@@ -11,37 +14,48 @@
 
 #include "corpus.hpp"
 #include "encoding.hpp"
+#include "ngram_model.hpp"
+#include "ngram_pruning.hpp"
 #include "tables.hpp"
 #include "utils.hpp"
 
-void make_dict(std::shared_ptr<SyllableTable> sy_table,
-               std::shared_ptr<CharTable> ch_table,
-               const std::string &dataset) {
-  clock_t start = clock();
-
-  auto word_table = std::make_shared<WordTable>();
-
-  read_lines("extra/words_base.txt", [&](std::string &line) {
-    auto index = line.find(' ');
-    assert(index != std::string::npos);
-    auto pinyin = sy_table->split(line.substr(index + 1));
-    word_table->insert(line.substr(0, index), std::move(pinyin));
-  });
-
-  cppjieba::MixSegment seg("extra/jieba.dict.utf8", "extra/hmm_model.utf8");
-
-  auto punctuations = load_punctuations();
-
-  iconv_t ic = iconv_open("GBK", "UTF-8");
-
-  std::vector<u64> uni_freqs;
-  std::vector<std::unordered_map<Word, u64>> bi_freqs;
-  uni_freqs.resize(word_table->size());
-  bi_freqs.resize(word_table->size());
-
-  const auto base_words_size = word_table->size();
+/**
+ * Unigram & bigram counts over a part of the corpus.
+ *
+ * Words missing from the base word table get local IDs in order of discovery,
+ * starting right after the base words. Counters are merged into the global
+ * tables in corpus order, which reproduces the IDs of a serial scan.
+ */
+struct DictCounter {
+  DISABLE_COPY(DictCounter);
+
+  DictCounter(const WordTable &word_table, const CharTable &ch_table,
+              const std::unordered_set<std::string> &punctuations)
+      : word_table(word_table), ch_table(ch_table), punctuations(punctuations),
+        uni_freqs(word_table.size()),
+        bi_freqs(word_table.size()) {}
+
+  /**
+   * Gets the local index of a word, allocating one for new Chinese words.
+   */
+  Word get(const std::string &word) {
+    auto w = word_table.get(word);
+    if (w != INVALID_WORD)
+      return w;
+    auto it = new_table.find(word);
+    if (it != new_table.end())
+      return it->second;
+    if (!is_chinese(ch_table, word))
+      return INVALID_WORD;
+    w = uni_freqs.size();
+    new_table[word] = w;
+    new_words.push_back(word);
+    uni_freqs.emplace_back();
+    bi_freqs.emplace_back();
+    return w;
+  }
 
-  auto add_words = [&](const std::vector<std::string> &words) {
+  void add_words(const std::vector<std::string> &words) {
     Word pre = INVALID_WORD;
     auto feed_word = [&](Word word) {
       if (word != INVALID_WORD) {
@@ -59,18 +73,13 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
         if (prev_is_punc) {
           continue;
         }
-        feed_word(word_table->eos());
+        feed_word(word_table.eos());
         prev_is_punc = true;
       } else {
-        auto w = word_table->get(word);
-        if (w == INVALID_WORD && is_chinese(ic, *ch_table, word)) {
-          w = word_table->insert(word, {});
-          uni_freqs.emplace_back();
-          bi_freqs.emplace_back();
-        }
+        auto w = get(word);
         if (w != INVALID_WORD) {
           if (prev_is_punc) {
-            feed_word(word_table->sos());
+            feed_word(word_table.sos());
           }
           feed_word(w);
         } else {
@@ -79,18 +88,125 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
         prev_is_punc = false;
       }
     }
-  };
+  }
+
+  const WordTable &word_table;
+  const CharTable &ch_table;
+  const std::unordered_set<std::string> &punctuations;
+
+  std::unordered_map<std::string, Word> new_table;
+  std::vector<std::string> new_words;
+
+  std::vector<u64> uni_freqs;
+  std::vector<std::unordered_map<Word, u64>> bi_freqs;
+};
+
+void make_dict(std::shared_ptr<SyllableTable> sy_table,
+               std::shared_ptr<CharTable> ch_table, const std::string &dataset,
+               size_t threads, u32 count_bits,
+               const NgramPruningOptions &pruning, bool freq_order) {
+  auto start = std::chrono::steady_clock::now();
 
-  std::vector<std::string> words;
+  auto word_table = std::make_shared<WordTable>();
+
+  read_lines("extra/words_base.txt", [&](std::string &line) {
+    auto index = line.find(' ');
+    assert(index != std::string::npos);
+    auto pinyin = sy_table->split(line.substr(index + 1));
+    word_table->insert(line.substr(0, index), std::move(pinyin));
+  });
+
+  cppjieba::MixSegment seg("extra/jieba.dict.utf8", "extra/hmm_model.utf8");
+
+  auto punctuations = load_punctuations();
+
+  const auto base_words_size = word_table->size();
 
   CorpusOptions options;
   get_dataset_options(dataset, options);
-  options.progress = true;
-  read_corpus(options, [&](const std::string &text) {
-    words.clear();
-    seg.Cut(text, words);
-    add_words(words);
-  });
+
+  std::vector<std::unique_ptr<DictCounter>> counters;
+  for (size_t t = 0; t < threads; t++) {
+    counters.emplace_back(
+        new DictCounter(*word_table, *ch_table, punctuations));
+  }
+
+  if (threads == 1) {
+    std::vector<std::string> words;
+    options.progress = true;
+    read_corpus(options, [&](Span<char> text) {
+      words.clear();
+      seg.Cut(std::string(text.begin(), text.end()), words);
+      counters[0]->add_words(words);
+    });
+  } else {
+    // Each thread scans a contiguous run of shards, so that counters are
+    // ordered the same way as the corpus
+    auto start = std::chrono::steady_clock::now();
+    auto shards = split_corpus(options, threads);
+
+    std::vector<CorpusStats> thread_stats(threads);
+    std::atomic<size_t> done(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back([&, t]() {
+        std::vector<std::string> words;
+        auto &counter = *counters[t];
+        size_t first = shards.size() * t / threads;
+        size_t last = shards.size() * (t + 1) / threads;
+        for (size_t k = first; k < last; k++) {
+          thread_stats[t] +=
+              read_corpus_shard(options, shards[k], [&](Span<char> text) {
+                words.clear();
+                seg.Cut(std::string(text.begin(), text.end()), words);
+                counter.add_words(words);
+              });
+          std::cerr << "Processed shard " << ++done << '/' << shards.size()
+                    << '\n';
+        }
+      });
+    }
+    for (auto &worker : workers)
+      worker.join();
+
+    CorpusStats stats;
+    for (auto &s : thread_stats)
+      stats += s;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    report_corpus_stats(stats, elapsed.count());
+  }
+
+  // Merge counters in corpus order. The first counter's local indices are
+  // already global, so it is moved instead of copied.
+  for (auto &counter : counters) {
+    for (auto &word : counter->new_words) {
+      if (word_table->get(word) == INVALID_WORD)
+        word_table->insert(word, {});
+    }
+  }
+  std::vector<u64> uni_freqs = std::move(counters[0]->uni_freqs);
+  std::vector<std::unordered_map<Word, u64>> bi_freqs =
+      std::move(counters[0]->bi_freqs);
+  uni_freqs.resize(word_table->size());
+  bi_freqs.resize(word_table->size());
+  for (size_t t = 1; t < threads; t++) {
+    auto &counter = *counters[t];
+    std::vector<Word> local_map(counter.uni_freqs.size());
+    std::iota(local_map.begin(), local_map.begin() + base_words_size, 0);
+    for (size_t k = 0; k < counter.new_words.size(); k++) {
+      local_map[base_words_size + k] = word_table->get(counter.new_words[k]);
+    }
+    for (Word w = 0; w < counter.uni_freqs.size(); w++) {
+      uni_freqs[local_map[w]] += counter.uni_freqs[w];
+      auto &row = bi_freqs[local_map[w]];
+      for (auto &p : counter.bi_freqs[w]) {
+        row[local_map[p.first]] += p.second;
+      }
+    }
+    counters[t].reset();
+  }
+  counters.clear();
 
   std::vector<Word> word_map, new_words;
   word_map.resize(word_table->size());
@@ -106,19 +222,55 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
     }
   }
 
+  // Kept words by their new index. With `freq_order`, hot words come first
+  // (after <s> and </s>), so their rows share cache lines and pages and
+  // their indices take fewer ULEB bytes.
+  std::vector<Word> renumbered = new_words;
+  if (freq_order) {
+    std::stable_sort(
+        renumbered.begin() + 2, renumbered.end(),
+        [&](Word a, Word b) { return uni_freqs[a] > uni_freqs[b]; });
+    for (Word w = 0; w < renumbered.size(); w++) {
+      word_map[renumbered[w]] = w;
+    }
+  }
+
   std::ofstream words_file("extra/dict_words_" + dataset + ".txt");
-  for (auto word : new_words) {
+  WordTable kept_words;
+  for (auto word : renumbered) {
     words_file << word_table->word(word);
-    auto &pinyin = word_table->pinyin(word);
+    auto pinyin = word_table->pinyin(word);
     for (size_t j = 0; j < pinyin.size(); j++) {
       words_file << ' ' << sy_table->spelling(pinyin[j]);
     }
     words_file << '\n';
+    if (word != word_table->sos() && word != word_table->eos())
+      kept_words.insert(word_table->word(word), pinyin);
   }
   words_file.close();
+  // The image is what `run` loads, the word list is kept for inspection
+  kept_words.save(("extra/dict_words_" + dataset + ".table").data());
 
-  std::ofstream dict_file("extra/dict_" + dataset + ".bin", std::ios::binary);
+  // Entropy pruning estimates the bigram model of `WordIME`, with unigram
+  // probabilities as the lower order
+  u64 total = 0;
   for (auto word : new_words) {
+    total += uni_freqs[word];
+  }
+  const double lambda = WordIMEOptions().lambda;
+  auto keep_bigram = [&](Word word1, Word word2, u64 count) {
+    if (count < pruning.min_bigram_count)
+      return false;
+    return !pruning.entropy_threshold ||
+           pruning_entropy(count, uni_freqs[word1],
+                           (double)uni_freqs[word2] / total, total,
+                           lambda) >= pruning.entropy_threshold;
+  };
+  size_t bigram_count = 0, pruned_bigrams = 0;
+
+  auto dict_path = "extra/dict_" + dataset + ".bin";
+  std::ofstream dict_file(dict_path, std::ios::binary);
+  for (auto word : renumbered) {
     write_uleb(dict_file, uni_freqs[word]);
 
     std::vector<Word> c1_words;
@@ -127,6 +279,11 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
       auto w = word_map[p.first];
       if (w == INVALID_WORD)
         continue;
+      bigram_count++;
+      if (!keep_bigram(word, p.first, p.second)) {
+        pruned_bigrams++;
+        continue;
+      }
       if (p.second == 1) {
         c1_words.push_back(w);
       } else {
@@ -143,6 +300,7 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
     }
 
     write_uleb(dict_file, other_words.size());
+    std::sort(other_words.begin(), other_words.end());
     last = 0;
     for (auto &p : other_words) {
       write_uleb(dict_file, p.first - last);
@@ -151,10 +309,23 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
     }
   }
   dict_file.close();
+  std::cerr << "Pruned bigrams: " << pruned_bigrams << '/' << bigram_count
+            << '\n';
+
+  // Also emit the binary image, which `run` maps without parsing
+  NgramModel model;
+  model.load(dict_path.data(), new_words.size(), 2);
+  if (count_bits < 32) {
+    size_t full_bytes = model.image_bytes();
+    model.quantize(count_bits);
+    std::cerr << "Quantized model: " << model.image_bytes() << " bytes ("
+              << full_bytes << " with full counts)\n";
+  }
+  model.save(("extra/dict_" + dataset + ".model").data());
 
-  clock_t end = clock();
-  std::cerr << "Build time: " << (end - start) / (double)CLOCKS_PER_SEC
-            << "s\n";
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Build time: " << elapsed.count() << "s\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -164,90 +335,96 @@ int main(int argc, char *argv[]) {
 #endif
 
   if (argc < 3) {
-    std::cerr << "Usage: " << argv[0] << " {make-dict, run} <dataset>\n";
+    std::cerr << "Usage: " << argv[0]
+              << " {make-dict, run} <dataset> [--threads N]"
+                 " [--quantize {8, 16}] [--min-bigram N] [--entropy T]"
+                 " [--freq-order]\n";
     return 1;
   }
 
+  size_t threads = 1;
+  u32 count_bits = 32;
+  NgramPruningOptions pruning;
+  bool freq_order = false;
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--quantize") && i + 1 < argc) {
+      count_bits = atoi(argv[++i]);
+      if (count_bits != 8 && count_bits != 16) {
+        std::cerr << "Quantization must be 8 or 16 bits\n";
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--min-bigram") && i + 1 < argc) {
+      pruning.min_bigram_count = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--entropy") && i + 1 < argc) {
+      pruning.entropy_threshold = std::max(atof(argv[++i]), 0.);
+    } else if (!strcmp(argv[i], "--freq-order")) {
+      freq_order = true;
+    } else {
+      std::cerr << "Unknown option: " << argv[i] << '\n';
+      return 1;
+    }
+  }
+
   auto sy_table = std::make_shared<SyllableTable>();
   auto ch_table = std::make_shared<CharTable>();
   init_tables(*sy_table, *ch_table);
 
   std::string dataset = argv[2];
   if (!strcmp(argv[1], "make-dict")) {
-    make_dict(std::move(sy_table), std::move(ch_table), dataset);
+    make_dict(std::move(sy_table), std::move(ch_table), dataset, threads,
+              count_bits, pruning, freq_order);
     return 0;
   } else if (strcmp(argv[1], "run")) {
     std::cerr << "Unknown command: " << argv[1] << '\n';
     return 1;
   }
 
-  clock_t start = clock();
+  auto start = std::chrono::steady_clock::now();
 
   auto word_table = std::make_shared<WordTable>();
-
-  if (!std::ifstream("extra/dict_words_" + dataset + ".txt")) {
+  if (!load_dict_words(*sy_table, *word_table, "extra/dict_words_" + dataset)) {
     std::cerr << "Failed to open dict. Try running \"make-dict\" first\n";
     return 1;
   }
 
-  auto words_path = "extra/dict_words_" + dataset + ".txt";
-  read_lines(words_path.data(), [&](const std::string &line) {
-    if (line == "<s>" || line == "</s>")
-      return;
-    auto index = line.find(' ');
-    std::vector<Syllable> pinyin;
-    if (index != std::string::npos) {
-      pinyin = sy_table->split(line.substr(index + 1));
-    }
-    word_table->insert(line.substr(0, index), pinyin);
-  });
-
-  auto dict_path = "extra/dict_" + dataset + ".bin";
+  auto dict_path = "extra/dict_" + dataset + ".model";
+  if (!std::ifstream(dict_path)) {
+    dict_path = "extra/dict_" + dataset + ".bin";
+  }
   WordIME ime(word_table, dict_path.data());
   // ime.options.debug = true;
 
-  clock_t end = clock();
-  std::cerr << "Load time: " << (end - start) / (double)CLOCKS_PER_SEC << "s\n";
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Load time: " << elapsed.count() << "s\n";
+
+  ime.set_threads(threads);
 
 #ifndef GRID_SEARCH
-  start = clock();
-
-  std::string line;
-  while (std::getline(std::cin, line)) {
-    auto syllables = sy_table->split(line);
-    try {
-      auto result = ime.translate(syllables);
-      std::cout << result << '\n';
-    } catch (const std::exception &e) {
-      std::cerr << "Error: " << e.what() << '\n';
-    }
-  }
+  start = std::chrono::steady_clock::now();
+
+  translate_lines(ime, *sy_table, std::cin, std::cout);
 
-  end = clock();
-  std::cerr << "Translate time: " << (end - start) / (double)CLOCKS_PER_SEC
-            << "s\n";
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cerr << "Translate time: " << elapsed.count() << "s\n";
 #else
 
-  std::vector<std::vector<Syllable>> inputs;
-
-  std::string line;
-  while (std::getline(std::cin, line)) {
-    auto syllables = sy_table->split(line);
-    inputs.push_back(syllables);
-  }
+  auto inputs = read_syllable_lines(*sy_table, std::cin);
 
   for (int i = 1; i <= 8; i++) {
     ime.options.lambda = 1.0 - std::pow(10.0, -i);
+    ime.prepare();
     std::stringstream ss;
     ss << "outputs1/output_" << i << ".txt";
     std::cerr << ss.str() << '\n';
     std::ofstream out(ss.str());
-    for (auto &syllables : inputs) {
-      try {
-        auto result = ime.translate(syllables);
-        out << result << '\n';
-      } catch (const std::exception &e) {
-        std::cerr << "Error: " << e.what() << '\n';
+    for (auto &result : ime.translate_batch(inputs)) {
+      if (result.ok) {
+        out << result.text << '\n';
+      } else {
+        std::cerr << "Error: " << result.text << '\n';
       }
     }
   }
@@ -1,8 +1,12 @@
 
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <numeric>
+#include <sstream>
+#include <thread>
 #include <unordered_set>
 
 #include "cppjieba/MixSegment.hpp"
@@ -11,47 +15,67 @@
 
 #include "corpus.hpp"
 #include "encoding.hpp"
+#include "ngram_model.hpp"
+#include "ngram_pruning.hpp"
 #include "tables.hpp"
+#include "trigram_spill.hpp"
 #include "utils.hpp"
 
-void make_dict(std::shared_ptr<SyllableTable> sy_table,
-               std::shared_ptr<CharTable> ch_table,
-               const std::string &dataset) {
-  clock_t start = clock();
-
-  auto word_table = std::make_shared<WordTable>();
-
-  read_lines("extra/words_base.txt", [&](std::string &line) {
-    auto index = line.find(' ');
-    assert(index != std::string::npos);
-    auto pinyin = sy_table->split(line.substr(index + 1));
-    word_table->insert(line.substr(0, index), std::move(pinyin));
-  });
-
-  cppjieba::MixSegment seg("extra/jieba.dict.utf8", "extra/hmm_model.utf8");
-
-  auto punctuations = load_punctuations();
-
-  iconv_t ic = iconv_open("GBK", "UTF-8");
-
-  std::vector<u64> uni_freqs;
-  std::vector<std::unordered_map<Word, u32>> bi_freqs;
-  std::vector<std::unordered_map<Word, std::unordered_map<Word, u32>>>
-      tri_freqs;
-  uni_freqs.resize(word_table->size());
-  bi_freqs.resize(word_table->size());
-  tri_freqs.resize(word_table->size());
-
-  const auto base_words_size = word_table->size();
+/// Interpolation weights used by `run`, and assumed by entropy pruning.
+const double ALPHA = 0.999998, BETA = 0.15;
+
+/// Maximum number of spilled runs merged at once.
+const size_t MAX_MERGED_RUNS = 256;
+
+/**
+ * Unigram, bigram & trigram counts over a part of the corpus.
+ *
+ * Words missing from the base word table get local IDs in order of discovery,
+ * starting right after the base words. Counters are merged into the global
+ * tables in corpus order, which reproduces the IDs of a serial scan.
+ */
+struct DictCounter {
+  DISABLE_COPY(DictCounter);
+
+  DictCounter(const WordTable &word_table, const CharTable &ch_table,
+              const std::unordered_set<std::string> &punctuations)
+      : word_table(word_table), ch_table(ch_table), punctuations(punctuations),
+        uni_freqs(word_table.size()),
+        bi_freqs(word_table.size()), tri_freqs(word_table.size()) {}
+
+  /**
+   * Gets the local index of a word, allocating one for new Chinese words.
+   */
+  Word get(const std::string &word) {
+    auto w = word_table.get(word);
+    if (w != INVALID_WORD)
+      return w;
+    auto it = new_table.find(word);
+    if (it != new_table.end())
+      return it->second;
+    if (!is_chinese(ch_table, word))
+      return INVALID_WORD;
+    w = uni_freqs.size();
+    new_table[word] = w;
+    new_words.push_back(word);
+    uni_freqs.emplace_back();
+    bi_freqs.emplace_back();
+    tri_freqs.emplace_back();
+    return w;
+  }
 
-  auto add_words = [&](const std::vector<std::string> &words) {
+  void add_words(const std::vector<std::string> &words) {
     Word pre2 = INVALID_WORD, pre1 = INVALID_WORD;
     auto feed_word = [&](Word word) {
       if (word != INVALID_WORD) {
         if (pre1 != INVALID_WORD) {
           bi_freqs[pre1][word]++;
           if (pre2 != INVALID_WORD) {
-            tri_freqs[pre2][pre1][word]++;
+            if (spill) {
+              spill->add(pre2, pre1, word);
+            } else {
+              tri_freqs[pre2][pre1][word]++;
+            }
           }
         }
         uni_freqs[word]++;
@@ -66,20 +90,14 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
         if (prev_is_punc) {
           continue;
         }
-        feed_word(word_table->eos());
+        feed_word(word_table.eos());
         pre2 = pre1 = INVALID_WORD;
         prev_is_punc = true;
       } else {
-        auto w = word_table->get(word);
-        if (w == INVALID_WORD && is_chinese(ic, *ch_table, word)) {
-          w = word_table->insert(word, {});
-          uni_freqs.emplace_back();
-          bi_freqs.emplace_back();
-          tri_freqs.emplace_back();
-        }
+        auto w = get(word);
         if (w != INVALID_WORD) {
           if (prev_is_punc) {
-            feed_word(word_table->sos());
+            feed_word(word_table.sos());
           }
           feed_word(w);
         } else {
@@ -88,18 +106,159 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
         prev_is_punc = false;
       }
     }
-  };
+  }
+
+  const WordTable &word_table;
+  const CharTable &ch_table;
+  const std::unordered_set<std::string> &punctuations;
 
-  std::vector<std::string> words;
+  std::unordered_map<std::string, Word> new_table;
+  std::vector<std::string> new_words;
+
+  std::vector<u64> uni_freqs;
+  std::vector<std::unordered_map<Word, u32>> bi_freqs;
+  std::vector<std::unordered_map<Word, std::unordered_map<Word, u32>>>
+      tri_freqs;
+  /// Trigram counts when counting in external memory, instead of `tri_freqs`.
+  std::unique_ptr<TrigramSpill> spill;
+};
+
+void make_dict(std::shared_ptr<SyllableTable> sy_table,
+               std::shared_ptr<CharTable> ch_table, const std::string &dataset,
+               size_t threads, size_t memory_mb, u32 count_bits,
+               const NgramPruningOptions &pruning, bool freq_order) {
+  auto start = std::chrono::steady_clock::now();
+
+  auto word_table = std::make_shared<WordTable>();
+
+  read_lines("extra/words_base.txt", [&](std::string &line) {
+    auto index = line.find(' ');
+    assert(index != std::string::npos);
+    auto pinyin = sy_table->split(line.substr(index + 1));
+    word_table->insert(line.substr(0, index), std::move(pinyin));
+  });
+
+  cppjieba::MixSegment seg("extra/jieba.dict.utf8", "extra/hmm_model.utf8");
+
+  auto punctuations = load_punctuations();
+
+  const auto base_words_size = word_table->size();
 
   CorpusOptions options;
   get_dataset_options(dataset, options);
-  options.progress = true;
-  read_corpus(options, [&](const std::string &text) {
-    words.clear();
-    seg.Cut(text, words);
-    add_words(words);
-  });
+
+  std::vector<std::unique_ptr<DictCounter>> counters;
+  for (size_t t = 0; t < threads; t++) {
+    counters.emplace_back(
+        new DictCounter(*word_table, *ch_table, punctuations));
+    if (memory_mb) {
+      size_t buffer_size =
+          (memory_mb << 20) / sizeof(TrigramRecord) / threads;
+      counters[t]->spill.reset(new TrigramSpill(
+          "extra/dict_tri_" + dataset + ".run" + std::to_string(t),
+          buffer_size));
+    }
+  }
+
+  if (threads == 1) {
+    std::vector<std::string> words;
+    options.progress = true;
+    read_corpus(options, [&](Span<char> text) {
+      words.clear();
+      seg.Cut(std::string(text.begin(), text.end()), words);
+      counters[0]->add_words(words);
+    });
+  } else {
+    // Each thread scans a contiguous run of shards, so that counters are
+    // ordered the same way as the corpus
+    auto start = std::chrono::steady_clock::now();
+    auto shards = split_corpus(options, threads);
+
+    std::vector<CorpusStats> thread_stats(threads);
+    std::atomic<size_t> done(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back([&, t]() {
+        std::vector<std::string> words;
+        auto &counter = *counters[t];
+        size_t first = shards.size() * t / threads;
+        size_t last = shards.size() * (t + 1) / threads;
+        for (size_t k = first; k < last; k++) {
+          thread_stats[t] +=
+              read_corpus_shard(options, shards[k], [&](Span<char> text) {
+                words.clear();
+                seg.Cut(std::string(text.begin(), text.end()), words);
+                counter.add_words(words);
+              });
+          std::cerr << "Processed shard " << ++done << '/' << shards.size()
+                    << '\n';
+        }
+      });
+    }
+    for (auto &worker : workers)
+      worker.join();
+
+    CorpusStats stats;
+    for (auto &s : thread_stats)
+      stats += s;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    report_corpus_stats(stats, elapsed.count());
+  }
+
+  // Merge counters in corpus order. The first counter's local indices are
+  // already global, so it is moved instead of copied. Spilled runs are kept
+  // until the dictionary is written.
+  std::vector<std::unique_ptr<TrigramSpill>> spills;
+  for (auto &counter : counters) {
+    if (counter->spill) {
+      counter->spill->finish();
+      spills.push_back(std::move(counter->spill));
+    }
+  }
+  for (auto &counter : counters) {
+    for (auto &word : counter->new_words) {
+      if (word_table->get(word) == INVALID_WORD)
+        word_table->insert(word, {});
+    }
+  }
+  std::vector<u64> uni_freqs = std::move(counters[0]->uni_freqs);
+  std::vector<std::unordered_map<Word, u32>> bi_freqs =
+      std::move(counters[0]->bi_freqs);
+  std::vector<std::unordered_map<Word, std::unordered_map<Word, u32>>>
+      tri_freqs = std::move(counters[0]->tri_freqs);
+  uni_freqs.resize(word_table->size());
+  bi_freqs.resize(word_table->size());
+  tri_freqs.resize(word_table->size());
+  for (size_t t = 1; t < threads; t++) {
+    auto &counter = *counters[t];
+    std::vector<Word> local_map(counter.uni_freqs.size());
+    std::iota(local_map.begin(), local_map.begin() + base_words_size, 0);
+    for (size_t k = 0; k < counter.new_words.size(); k++) {
+      local_map[base_words_size + k] = word_table->get(counter.new_words[k]);
+    }
+    for (Word w = 0; w < counter.uni_freqs.size(); w++) {
+      uni_freqs[local_map[w]] += counter.uni_freqs[w];
+      auto &bi_row = bi_freqs[local_map[w]];
+      for (auto &p : counter.bi_freqs[w]) {
+        bi_row[local_map[p.first]] += p.second;
+      }
+      auto &tri_row = tri_freqs[local_map[w]];
+      for (auto &p : counter.tri_freqs[w]) {
+        auto &tri_col = tri_row[local_map[p.first]];
+        for (auto &q : p.second) {
+          tri_col[local_map[q.first]] += q.second;
+        }
+      }
+    }
+    if (!spills.empty())
+      spills[t]->remap(local_map);
+    counters[t].reset();
+  }
+  counters.clear();
+  for (auto &spill : spills) {
+    spill->merge_runs(MAX_MERGED_RUNS / spills.size());
+  }
 
   std::vector<Word> word_map, new_words;
   word_map.resize(word_table->size());
@@ -115,98 +274,231 @@ void make_dict(std::shared_ptr<SyllableTable> sy_table,
     }
   }
 
+  // Kept words by their new index. With `freq_order`, hot words come first
+  // (after <s> and </s>), so their rows share cache lines and pages and
+  // their indices take fewer ULEB bytes.
+  std::vector<Word> renumbered = new_words;
+  if (freq_order) {
+    std::stable_sort(
+        renumbered.begin() + 2, renumbered.end(),
+        [&](Word a, Word b) { return uni_freqs[a] > uni_freqs[b]; });
+    for (Word w = 0; w < renumbered.size(); w++) {
+      word_map[renumbered[w]] = w;
+    }
+  }
+
   std::ofstream words_file("extra/dict_tri_words_" + dataset + ".txt");
-  for (auto word : new_words) {
+  WordTable kept_words;
+  for (auto word : renumbered) {
     words_file << word_table->word(word);
-    auto &pinyin = word_table->pinyin(word);
+    auto pinyin = word_table->pinyin(word);
     for (size_t j = 0; j < pinyin.size(); j++) {
       words_file << ' ' << sy_table->spelling(pinyin[j]);
     }
     words_file << '\n';
+    if (word != word_table->sos() && word != word_table->eos())
+      kept_words.insert(word_table->word(word), pinyin);
   }
   words_file.close();
+  // The image is what `run` loads, the word list is kept for inspection
+  kept_words.save(("extra/dict_tri_words_" + dataset + ".table").data());
+
+  // Entropy pruning estimates the model of `WordTriIME` with the weights of
+  // `run`, where the lower order of bigrams is the unigram probability
+  u64 total = 0;
+  for (auto word : new_words) {
+    total += uni_freqs[word];
+  }
+  auto unigram_prob = [&](Word word) {
+    return (double)uni_freqs[word] / total;
+  };
+  auto bigram_prob = [&](Word word1, Word word2) {
+    auto it = bi_freqs[word1].find(word2);
+    u64 count = it == bi_freqs[word1].end() ? 0 : it->second;
+    return ALPHA * count / uni_freqs[word1] + (1 - ALPHA) * unigram_prob(word2);
+  };
+  auto keep_bigram = [&](Word word1, Word word2, u64 count) {
+    if (count < pruning.min_bigram_count)
+      return false;
+    return !pruning.entropy_threshold ||
+           pruning_entropy(count, uni_freqs[word1], unigram_prob(word2), total,
+                           ALPHA) >= pruning.entropy_threshold;
+  };
+  auto keep_trigram = [&](Word word2, Word word3, u64 count,
+                          u64 history_count) {
+    if (count < pruning.min_trigram_count)
+      return false;
+    return !pruning.entropy_threshold ||
+           pruning_entropy(count, history_count, bigram_prob(word2, word3),
+                           total, BETA) >= pruning.entropy_threshold;
+  };
+  size_t bigram_count = 0, pruned_bigrams = 0;
+  size_t trigram_count = 0, pruned_trigrams = 0;
+
+  /// A kept bigram, with the new indices and counts of its kept trigrams.
+  struct BigramEntry {
+    Word word;
+    u64 count;
+    std::vector<std::pair<Word, u64>> trigrams;
+  };
+
+  // Spilled trigrams are merged in the order of their first word, like
+  // `new_words`, so only the row being written is loaded into `tri_freqs`
+  std::unique_ptr<TrigramMerger> merger;
+  TrigramRecord record;
+  bool has_record = false;
+  if (!spills.empty()) {
+    std::vector<std::string> runs;
+    for (auto &spill : spills) {
+      runs.insert(runs.end(), spill->runs().begin(), spill->runs().end());
+    }
+    std::cerr << "Merging " << runs.size() << " trigram runs\n";
+    merger.reset(new TrigramMerger(runs));
+    has_record = merger->next(record);
+  }
 
-  std::ofstream dict_file("extra/dict_tri_" + dataset + ".bin",
-                          std::ios::binary);
+  auto dict_path = "extra/dict_tri_" + dataset + ".bin";
+  std::ofstream dict_file(dict_path, std::ios::binary);
+  // Rows are built in the order of the merged trigrams. Renumbered rows are
+  // buffered and written in their new order at the end.
+  std::vector<std::string> rows(freq_order ? new_words.size() : 0);
+  std::ostringstream row;
   for (auto word : new_words) {
-    write_uleb(dict_file, uni_freqs[word]);
+    std::ostream &out = freq_order ? (std::ostream &)row : dict_file;
+    write_uleb(out, uni_freqs[word]);
+    for (; merger && has_record && record.word1 <= word;
+         has_record = merger->next(record)) {
+      if (record.word1 == word)
+        tri_freqs[word][record.word2][record.word3] = record.count;
+    }
 
     std::vector<std::pair<Word, Word>> c1_words;
-    std::vector<std::pair<Word, u64>> other_words;
+    std::vector<BigramEntry> other_words;
     for (auto &p : bi_freqs[word]) {
       auto w = word_map[p.first];
       if (w == INVALID_WORD)
         continue;
-      if (p.second == 1) {
-        auto it = tri_freqs[word].find(p.first);
-        Word third = word_table->sos();
-        if (it != tri_freqs[word].end()) {
-          assert(it->second.size() == 1);
-          third = it->second.begin()->first;
-        }
-        third = word_map[third];
-        if (third == INVALID_WORD)
+      auto it = tri_freqs[word].find(p.first);
+      if (p.second == 1 && it != tri_freqs[word].end()) {
+        assert(it->second.size() == 1);
+        if (word_map[it->second.begin()->first] == INVALID_WORD)
           continue;
+      }
+      bigram_count++;
+
+      BigramEntry entry{w, p.second, {}};
+      if (it != tri_freqs[word].end()) {
+        for (auto &tp : it->second) {
+          auto w3 = word_map[tp.first];
+          if (w3 == INVALID_WORD)
+            continue;
+          trigram_count++;
+          if (keep_trigram(p.first, tp.first, tp.second, p.second)) {
+            entry.trigrams.emplace_back(w3, tp.second);
+          } else {
+            pruned_trigrams++;
+          }
+        }
+      }
+      // Bigrams with kept trigrams are only subject to the count cutoff
+      bool keep = entry.trigrams.empty()
+                      ? keep_bigram(word, p.first, p.second)
+                      : p.second >= pruning.min_bigram_count;
+      if (!keep) {
+        pruned_bigrams++;
+        pruned_trigrams += entry.trigrams.size();
+        continue;
+      }
+
+      if (p.second == 1) {
+        // A third word of <s> marks a bigram without a following word
+        Word third = entry.trigrams.empty() ? word_table->sos()
+                                            : entry.trigrams[0].first;
         c1_words.emplace_back(w, third);
       } else {
-        other_words.emplace_back(w, p.second);
+        other_words.push_back(std::move(entry));
       }
     }
 
-    write_uleb(dict_file, c1_words.size());
+    write_uleb(out, c1_words.size());
     std::sort(c1_words.begin(), c1_words.end());
     Word last = 0;
     for (auto pa : c1_words) {
-      write_uleb(dict_file, pa.first - last);
+      write_uleb(out, pa.first - last);
       last = pa.first;
-      write_uleb(dict_file, pa.second);
+      write_uleb(out, pa.second);
     }
 
-    write_uleb(dict_file, other_words.size());
-    std::sort(other_words.begin(), other_words.end());
+    write_uleb(out, other_words.size());
+    std::sort(other_words.begin(), other_words.end(),
+              [](const BigramEntry &a, const BigramEntry &b) {
+                return a.word < b.word;
+              });
     last = 0;
-    for (auto &p : other_words) {
-      write_uleb(dict_file, p.first - last);
-      last = p.first;
-      u64 all = p.second;
+    for (auto &entry : other_words) {
+      write_uleb(out, entry.word - last);
+      last = entry.word;
+      u64 all = entry.count;
       std::vector<Word> c1_tri;
-      std::vector<std::pair<Word, u32>> other_tri;
-      for (auto &tp : tri_freqs[word][new_words[p.first]]) {
-        auto w = word_map[tp.first];
-        if (w == INVALID_WORD)
-          continue;
+      std::vector<std::pair<Word, u64>> other_tri;
+      for (auto &tp : entry.trigrams) {
         all -= tp.second;
         if (tp.second == 1) {
-          c1_tri.push_back(w);
+          c1_tri.push_back(tp.first);
         } else {
-          other_tri.emplace_back(w, tp.second);
+          other_tri.push_back(tp);
         }
       }
       std::sort(c1_tri.begin(), c1_tri.end());
       std::sort(other_tri.begin(), other_tri.end());
-      write_uleb(dict_file, all);
+      write_uleb(out, all);
 
-      write_uleb(dict_file, c1_tri.size());
+      write_uleb(out, c1_tri.size());
       Word last2 = 0;
       for (auto &p : c1_tri) {
-        write_uleb(dict_file, p - last2);
+        write_uleb(out, p - last2);
         last2 = p;
       }
 
-      write_uleb(dict_file, other_tri.size());
+      write_uleb(out, other_tri.size());
       last2 = 0;
       for (auto &p : other_tri) {
-        write_uleb(dict_file, p.first - last2);
+        write_uleb(out, p.first - last2);
         last2 = p.first;
-        write_uleb(dict_file, p.second);
+        write_uleb(out, p.second);
       }
     }
+    if (merger)
+      decltype(tri_freqs)::value_type().swap(tri_freqs[word]);
+    if (freq_order) {
+      rows[word_map[word]] = row.str();
+      row.str("");
+    }
+  }
+  for (auto &r : rows) {
+    dict_file << r;
   }
   dict_file.close();
+  merger.reset();
+  spills.clear();
+  std::cerr << "Pruned bigrams: " << pruned_bigrams << '/' << bigram_count
+            << ", trigrams: " << pruned_trigrams << '/' << trigram_count
+            << '\n';
+
+  // Also emit the binary image, which `run` maps without parsing
+  NgramModel model;
+  model.load(dict_path.data(), new_words.size(), 3);
+  if (count_bits < 32) {
+    size_t full_bytes = model.image_bytes();
+    model.quantize(count_bits);
+    std::cerr << "Quantized model: " << model.image_bytes() << " bytes ("
+              << full_bytes << " with full counts)\n";
+  }
+  model.save(("extra/dict_tri_" + dataset + ".model").data());
 
-  clock_t end = clock();
-  std::cerr << "Build time: " << (end - start) / (double)CLOCKS_PER_SEC
-            << "s\n";
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Build time: " << elapsed.count() << "s\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -216,86 +508,99 @@ int main(int argc, char *argv[]) {
 #endif
 
   if (argc < 3) {
-    std::cerr << "Usage: " << argv[0] << " {make-dict, run} <dataset>\n";
+    std::cerr << "Usage: " << argv[0]
+              << " {make-dict, run} <dataset> [--threads N] [--memory MB]"
+                 " [--quantize {8, 16}] [--min-bigram N]"
+                 " [--min-trigram N] [--entropy T] [--freq-order]\n";
     return 1;
   }
 
+  size_t threads = 1, memory_mb = 0;
+  u32 count_bits = 32;
+  NgramPruningOptions pruning;
+  bool freq_order = false;
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--memory") && i + 1 < argc) {
+      memory_mb = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--quantize") && i + 1 < argc) {
+      count_bits = atoi(argv[++i]);
+      if (count_bits != 8 && count_bits != 16) {
+        std::cerr << "Quantization must be 8 or 16 bits\n";
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--min-bigram") && i + 1 < argc) {
+      pruning.min_bigram_count = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--min-trigram") && i + 1 < argc) {
+      pruning.min_trigram_count = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--entropy") && i + 1 < argc) {
+      pruning.entropy_threshold = std::max(atof(argv[++i]), 0.);
+    } else if (!strcmp(argv[i], "--freq-order")) {
+      freq_order = true;
+    } else {
+      std::cerr << "Unknown option: " << argv[i] << '\n';
+      return 1;
+    }
+  }
+
   auto sy_table = std::make_shared<SyllableTable>();
   auto ch_table = std::make_shared<CharTable>();
   init_tables(*sy_table, *ch_table);
 
   std::string dataset = argv[2];
   if (!strcmp(argv[1], "make-dict")) {
-    make_dict(std::move(sy_table), std::move(ch_table), dataset);
+    make_dict(std::move(sy_table), std::move(ch_table), dataset, threads,
+              memory_mb, count_bits, pruning, freq_order);
     return 0;
   } else if (strcmp(argv[1], "run")) {
     std::cerr << "Unknown command: " << argv[1] << '\n';
     return 1;
   }
 
-  clock_t start = clock();
+  auto start = std::chrono::steady_clock::now();
 
   auto word_table = std::make_shared<WordTable>();
-
-  if (!std::ifstream("extra/dict_tri_words_" + dataset + ".txt")) {
+  auto words_prefix = "extra/dict_tri_words_" + dataset;
+  if (!load_dict_words(*sy_table, *word_table, words_prefix)) {
     std::cerr << "Failed to open dict. Try running \"make-dict\" first\n";
     return 1;
   }
 
-  auto words_path = "extra/dict_tri_words_" + dataset + ".txt";
-  read_lines(words_path.data(), [&](const std::string &line) {
-    if (line == "<s>" || line == "</s>")
-      return;
-    auto index = line.find(' ');
-    std::vector<Syllable> pinyin;
-    if (index != std::string::npos) {
-      pinyin = sy_table->split(line.substr(index + 1));
-    }
-    word_table->insert(line.substr(0, index), pinyin);
-  });
-
-  auto dict_path = "extra/dict_tri_" + dataset + ".bin";
+  auto dict_path = "extra/dict_tri_" + dataset + ".model";
+  if (!std::ifstream(dict_path)) {
+    dict_path = "extra/dict_tri_" + dataset + ".bin";
+  }
   WordTriIME ime(word_table, dict_path.data());
   // ime.options.debug = true;
 
-  ime.options.alpha = 0.999998;
-  ime.options.beta = 0.15;
+  ime.options.alpha = ALPHA;
+  ime.options.beta = BETA;
+  ime.prepare();
 
-  clock_t end = clock();
-  std::cerr << "Load time: " << (end - start) / (double)CLOCKS_PER_SEC << "s\n";
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Load time: " << elapsed.count() << "s\n";
+
+  ime.set_threads(threads);
 
 #ifndef GRID_SEARCH
-  start = clock();
-
-  std::string line;
-  while (std::getline(std::cin, line)) {
-    auto syllables = sy_table->split(line);
-    try {
-      auto result = ime.translate(syllables);
-      std::cout << result << '\n';
-    } catch (const std::exception &e) {
-      std::cerr << "Error: " << e.what() << '\n';
-    }
-  }
+  start = std::chrono::steady_clock::now();
 
-  end = clock();
-  std::cerr << "Translate time: " << (end - start) / (double)CLOCKS_PER_SEC
-            << "s\n";
+  translate_lines(ime, *sy_table, std::cin, std::cout);
 
-#else
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cerr << "Translate time: " << elapsed.count() << "s\n";
 
-  std::vector<std::vector<Syllable>> inputs;
+#else
 
-  std::string line;
-  while (std::getline(std::cin, line)) {
-    auto syllables = sy_table->split(line);
-    inputs.push_back(syllables);
-  }
+  auto inputs = read_syllable_lines(*sy_table, std::cin);
 
   for (int i = 10; i <= 10; i++) {
     ime.options.alpha = std::min(i / 10., 0.999998);
     for (int j = 150; j <= 250; j++) {
       ime.options.beta = std::min(j / 1000., 0.999998);
+      ime.prepare();
       // for (int i = 1; i <= 10; i++) {
       // ime.options.alpha = std::min(i / 10., 0.999998);
       // for (int j = 1; j <= 10; j++) {
@@ -305,12 +610,11 @@ int main(int argc, char *argv[]) {
       ss << "outputs3_" << dataset << "/output2_" << i << "_" << j << ".txt";
       std::cerr << ss.str() << '\n';
       std::ofstream out(ss.str());
-      for (auto &syllables : inputs) {
-        try {
-          auto result = ime.translate(syllables);
-          out << result << '\n';
-        } catch (const std::exception &e) {
-          std::cerr << "Error: " << e.what() << '\n';
+      for (auto &result : ime.translate_batch(inputs)) {
+        if (result.ok) {
+          out << result.text << '\n';
+        } else {
+          std::cerr << "Error: " << result.text << '\n';
         }
       }
     }
@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+#include "codebook.hpp"
+#include "ngram_model.hpp"
+
+namespace {
+
+/// Section sizes (in bytes) of a model image.
+struct ImageLayout {
+  size_t unigrams, bigram_offsets, bigram_words, bigram_counts;
+  size_t trigram_offsets, trigram_words, trigram_counts;
+  size_t unigram_codebook, bigram_codebook, trigram_codebook;
+
+  explicit ImageLayout(const NgramModelHeader &h) {
+    size_t count_size = h.count_bits / 8, offset_size = h.offset_bits / 8;
+    size_t unigram_size = h.count_bits < 32 ? count_size : sizeof(u64);
+    unigrams = align8(h.word_count * unigram_size);
+    bigram_offsets = align8((h.word_count + 1) * offset_size);
+    bigram_words = align8(h.bigram_count * sizeof(Word));
+    bigram_counts = align8(h.bigram_count * count_size);
+    unigram_codebook = align8(h.unigram_codebook_size * sizeof(u64));
+    bigram_codebook = align8(h.bigram_codebook_size * sizeof(u32));
+    if (h.order == 3) {
+      trigram_offsets = align8((h.bigram_count + 1) * offset_size);
+      trigram_words = align8(h.trigram_count * sizeof(Word));
+      trigram_counts = align8(h.trigram_count * count_size);
+      trigram_codebook = align8(h.trigram_codebook_size * sizeof(u32));
+    } else {
+      trigram_offsets = trigram_words = trigram_counts = 0;
+      trigram_codebook = 0;
+    }
+  }
+
+  /// Section sizes in image order.
+  std::vector<size_t> sections() const {
+    return {unigrams,         bigram_offsets,  bigram_words,
+            bigram_counts,    trigram_offsets, trigram_words,
+            trigram_counts,   unigram_codebook, bigram_codebook,
+            trigram_codebook};
+  }
+
+  size_t total() const {
+    size_t size = align8(sizeof(NgramModelHeader));
+    for (auto section : sections()) {
+      size += section;
+    }
+    return size;
+  }
+};
+
+/// A bigram entry while parsing a ULEB dictionary.
+struct BigramEntry {
+  Word word;
+  u64 count;
+  size_t tri_start, tri_end;
+
+  bool operator<(const BigramEntry &other) const { return word < other.word; }
+};
+
+/// Offsets narrowed to `bits` (32 or 64) bits, as raw bytes.
+std::vector<u8> narrow_offsets(const std::vector<u64> &offsets, u32 bits) {
+  if (bits == 64) {
+    return std::vector<u8>((const u8 *)offsets.data(),
+                           (const u8 *)(offsets.data() + offsets.size()));
+  }
+  std::vector<u8> bytes(offsets.size() * sizeof(u32));
+  for (size_t i = 0; i < offsets.size(); i++) {
+    ((u32 *)bytes.data())[i] = offsets[i];
+  }
+  return bytes;
+}
+
+/**
+ * Encodes `size` counts as `bits`-bit codes, returning their codebook.
+ *
+ * Counts span orders of magnitude, so their bins are spaced by ratio. Zero
+ * counts (of words never seen) keep an exact code of their own.
+ */
+template <class T, class Counts>
+std::vector<T> encode_counts(const Counts &counts, u64 size, u32 bits,
+                             std::vector<u8> &codes) {
+  std::vector<T> sample(size), positive;
+  for (u64 i = 0; i < size; i++) {
+    sample[i] = counts[i];
+    if (sample[i])
+      positive.push_back(sample[i]);
+  }
+  u32 zero = positive.size() < sample.size();
+  Codebook<T> codebook;
+  codebook.build_log(std::move(positive), ((size_t)1 << bits) - zero);
+  codes.resize(size * bits / 8);
+  for (u64 i = 0; i < size; i++) {
+    u32 code = sample[i] ? codebook.encode(sample[i]) + zero : 0;
+    if (bits == 8) {
+      codes[i] = code;
+    } else {
+      ((u16 *)codes.data())[i] = code;
+    }
+  }
+  std::vector<T> book = codebook.entries();
+  if (zero)
+    book.insert(book.begin(), 0);
+  return book;
+}
+
+} // namespace
+
+void NgramModel::load(const char *path, size_t word_count, u32 order) {
+  assert((order == 2 || order == 3) && "Unsupported n-gram order");
+  std::unique_ptr<MappedFile> mapped(new MappedFile(path));
+
+  if (mapped->size() >= sizeof(NgramModelHeader) &&
+      !memcmp(mapped->data(), NGRAM_MODEL_MAGIC, sizeof(NGRAM_MODEL_MAGIC))) {
+    file = std::move(mapped);
+    attach(file->data(), file->size());
+    if (header->word_count != word_count || header->order != order) {
+      throw std::runtime_error("Model does not match the word table");
+    }
+  } else {
+    load_uleb(mapped->data(), mapped->data() + mapped->size(), word_count,
+              order);
+  }
+}
+
+void NgramModel::load_uleb(const u8 *ptr, const u8 *end, size_t word_count,
+                           u32 order) {
+  NgramModelHeader h;
+  memcpy(h.magic, NGRAM_MODEL_MAGIC, sizeof(h.magic));
+  h.version = NGRAM_MODEL_VERSION;
+  h.order = order;
+  h.word_count = word_count;
+  h.total = 0;
+  h.count_bits = 32;
+  h.unigram_codebook_size = 0;
+  h.bigram_codebook_size = h.trigram_codebook_size = 0;
+
+  std::vector<u64> uni(word_count), bi_offsets(1, 0), tri_offsets(1, 0);
+  std::vector<Word> bi_words, tri_words;
+  std::vector<u32> bi_counts, tri_counts;
+
+  std::vector<BigramEntry> row;
+  std::vector<std::pair<Word, u32>> row_tri;
+  for (Word i = 0; i < word_count; i++) {
+    row.clear();
+    row_tri.clear();
+
+    uni[i] = read_uleb(ptr);
+    h.total += uni[i];
+
+    u64 c1_size = read_uleb(ptr);
+    Word last = 0;
+    for (u64 j = 0; j < c1_size; j++) {
+      last += read_uleb(ptr);
+      size_t start = row_tri.size();
+      if (order == 3) {
+        Word w = read_uleb(ptr);
+        // A third word of <s> marks a bigram without a following word
+        if (w != 0)
+          row_tri.emplace_back(w, 1);
+      }
+      row.push_back({last, 1, start, row_tri.size()});
+    }
+
+    u64 other_size = read_uleb(ptr);
+    last = 0;
+    for (u64 j = 0; j < other_size; j++) {
+      last += read_uleb(ptr);
+      u64 count = read_uleb(ptr);
+      size_t start = row_tri.size();
+      if (order == 3) {
+        u64 c1_tri_size = read_uleb(ptr);
+        Word last2 = 0;
+        for (u64 k = 0; k < c1_tri_size; k++) {
+          last2 += read_uleb(ptr);
+          row_tri.emplace_back(last2, 1);
+          count++;
+        }
+
+        u64 other_tri_size = read_uleb(ptr);
+        last2 = 0;
+        for (u64 k = 0; k < other_tri_size; k++) {
+          last2 += read_uleb(ptr);
+          u32 tri_count = read_uleb(ptr);
+          row_tri.emplace_back(last2, tri_count);
+          count += tri_count;
+        }
+      }
+      row.push_back({last, count, start, row_tri.size()});
+    }
+
+    std::sort(row.begin(), row.end());
+    for (auto &e : row) {
+      bi_words.push_back(e.word);
+      bi_counts.push_back(e.count);
+      if (order == 3) {
+        std::sort(row_tri.begin() + e.tri_start, row_tri.begin() + e.tri_end);
+        for (size_t k = e.tri_start; k < e.tri_end; k++) {
+          tri_words.push_back(row_tri[k].first);
+          tri_counts.push_back(row_tri[k].second);
+        }
+        tri_offsets.push_back(tri_words.size());
+      }
+    }
+    bi_offsets.push_back(bi_words.size());
+  }
+  assert(ptr == end && "Trailing data in dictionary");
+
+  h.bigram_count = bi_words.size();
+  h.trigram_count = tri_words.size();
+  const u64 max_u32 = std::numeric_limits<u32>::max();
+  h.offset_bits =
+      h.bigram_count <= max_u32 && h.trigram_count <= max_u32 ? 32 : 64;
+  auto bi_offset_bytes = narrow_offsets(bi_offsets, h.offset_bits);
+  auto tri_offset_bytes = narrow_offsets(tri_offsets, h.offset_bits);
+
+  std::vector<Section> sections = {
+      {uni.data(), uni.size() * sizeof(u64)},
+      {bi_offset_bytes.data(), bi_offset_bytes.size()},
+      {bi_words.data(), bi_words.size() * sizeof(Word)},
+      {bi_counts.data(), bi_counts.size() * sizeof(u32)}};
+  if (order == 3) {
+    sections.push_back({tri_offset_bytes.data(), tri_offset_bytes.size()});
+    sections.push_back({tri_words.data(), tri_words.size() * sizeof(Word)});
+    sections.push_back({tri_counts.data(), tri_counts.size() * sizeof(u32)});
+  }
+  assemble(h, sections);
+}
+
+void NgramModel::quantize(u32 bits) {
+  assert((bits == 8 || bits == 16) && "Unsupported count bits");
+  assert(count_bits() == 32 && "Model is already quantized");
+
+  NgramModelHeader h = *header;
+  h.count_bits = bits;
+
+  std::vector<u8> uni_codes, bi_codes, tri_codes;
+  auto uni_book = encode_counts<u64>(unigrams, h.word_count, bits, uni_codes);
+  auto bi_book =
+      encode_counts<u32>(bigram_counts, h.bigram_count, bits, bi_codes);
+  std::vector<u32> tri_book;
+  if (h.order == 3)
+    tri_book =
+        encode_counts<u32>(trigram_counts, h.trigram_count, bits, tri_codes);
+  h.unigram_codebook_size = uni_book.size();
+  h.bigram_codebook_size = bi_book.size();
+  h.trigram_codebook_size = tri_book.size();
+
+  std::vector<Section> sections = {
+      {uni_codes.data(), uni_codes.size()},
+      {bigrams.offsets.data(), bigrams.offsets.bytes()},
+      {bigrams.keys.data(), bigrams.keys.size() * sizeof(Word)},
+      {bi_codes.data(), bi_codes.size()}};
+  if (h.order == 3) {
+    sections.push_back({trigrams.offsets.data(), trigrams.offsets.bytes()});
+    sections.push_back(
+        {trigrams.keys.data(), trigrams.keys.size() * sizeof(Word)});
+    sections.push_back({tri_codes.data(), tri_codes.size()});
+  } else {
+    sections.resize(sections.size() + 3, {nullptr, 0});
+  }
+  sections.push_back({uni_book.data(), uni_book.size() * sizeof(u64)});
+  sections.push_back({bi_book.data(), bi_book.size() * sizeof(u32)});
+  if (h.order == 3)
+    sections.push_back({tri_book.data(), tri_book.size() * sizeof(u32)});
+  assemble(h, sections);
+}
+
+void NgramModel::assemble(const NgramModelHeader &h,
+                          const std::vector<Section> &sections) {
+  ImageLayout layout(h);
+  auto sizes = layout.sections();
+  assert(sections.size() <= sizes.size() && "Too many sections");
+
+  // Sections may point into the current image, so build a new one aside
+  std::vector<u64> image(layout.total() / sizeof(u64), 0);
+  u8 *out = (u8 *)image.data();
+  memcpy(out, &h, sizeof(h));
+  out += align8(sizeof(h));
+  for (size_t i = 0; i < sizes.size(); i++) {
+    if (i < sections.size() && sections[i].size) {
+      assert(sections[i].size <= sizes[i] && "Section overflow");
+      memcpy(out, sections[i].data, sections[i].size);
+    }
+    out += sizes[i];
+  }
+
+  file.reset();
+  owned.swap(image);
+  attach((const u8 *)owned.data(), layout.total());
+}
+
+void NgramModel::attach(const u8 *data, size_t size) {
+  if (size < sizeof(NgramModelHeader)) {
+    throw std::runtime_error("Model image is truncated");
+  }
+  auto h = (const NgramModelHeader *)data;
+  if (memcmp(h->magic, NGRAM_MODEL_MAGIC, sizeof(h->magic)) ||
+      h->version != NGRAM_MODEL_VERSION ||
+      (h->count_bits != 8 && h->count_bits != 16 && h->count_bits != 32) ||
+      (h->offset_bits != 32 && h->offset_bits != 64)) {
+    throw std::runtime_error("Unsupported model image");
+  }
+  u64 max_codebook = h->count_bits < 32 ? (u64)1 << h->count_bits : 0;
+  if (h->unigram_codebook_size > max_codebook ||
+      h->bigram_codebook_size > max_codebook ||
+      h->trigram_codebook_size > max_codebook) {
+    throw std::runtime_error("Invalid model codebook");
+  }
+  ImageLayout layout(*h);
+  if (size != layout.total()) {
+    throw std::runtime_error("Model image size mismatch");
+  }
+
+  header = h;
+  image = data;
+  image_size = size;
+
+  const u8 *p = data + align8(sizeof(NgramModelHeader));
+  const u8 *uni_counts = p;
+  p += layout.unigrams;
+  bigrams.offsets = OffsetArray(p, h->word_count + 1, h->offset_bits);
+  p += layout.bigram_offsets;
+  bigrams.keys = Span<Word>((const Word *)p, h->bigram_count);
+  p += layout.bigram_words;
+  const u8 *bi_counts = p;
+  p += layout.bigram_counts;
+  const u8 *tri_counts = nullptr;
+  if (h->order == 3) {
+    trigrams.offsets = OffsetArray(p, h->bigram_count + 1, h->offset_bits);
+    p += layout.trigram_offsets;
+    trigrams.keys = Span<Word>((const Word *)p, h->trigram_count);
+    p += layout.trigram_words;
+    tri_counts = p;
+    p += layout.trigram_counts;
+  } else {
+    trigrams = NgramTable();
+  }
+
+  Span<u64> uni_book((const u64 *)p, h->unigram_codebook_size);
+  p += layout.unigram_codebook;
+  Span<u32> bi_book((const u32 *)p, h->bigram_codebook_size);
+  p += layout.bigram_codebook;
+  Span<u32> tri_book((const u32 *)p, h->trigram_codebook_size);
+  unigrams = CountArray<u64>(uni_counts, h->count_bits, uni_book);
+  bigram_counts = CountArray<u32>(bi_counts, h->count_bits, bi_book);
+  trigram_counts = CountArray<u32>(tri_counts, h->count_bits, tri_book);
+}
+
+void NgramModel::save(const char *path) const {
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    throw std::runtime_error(std::string("Failed to open file: ") + path);
+  }
+  out.write((const char *)image, image_size);
+}
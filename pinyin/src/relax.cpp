@@ -0,0 +1,83 @@
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "relax.hpp"
+
+static void relax_scalar(double base, const float *edges, size_t n,
+                         double *scores, u32 *prevs, u32 prev) {
+  for (size_t k = 0; k < n; k++) {
+    double score = base + edges[k];
+    if (score > scores[k]) {
+      scores[k] = score;
+      prevs[k] = prev;
+    }
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("avx2"))) static void
+relax_avx2(double base, const float *edges, size_t n, double *scores,
+           u32 *prevs, u32 prev) {
+  const __m256d base4 = _mm256_set1_pd(base);
+  const __m128i prev4 = _mm_set1_epi32(prev);
+  // Low halves of the 64-bit comparison lanes, as 32-bit lanes
+  const __m256i halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m256d score =
+        _mm256_add_pd(base4, _mm256_cvtps_pd(_mm_loadu_ps(edges + k)));
+    __m256d old = _mm256_loadu_pd(scores + k);
+    __m256d better = _mm256_cmp_pd(score, old, _CMP_GT_OQ);
+    if (_mm256_testz_pd(better, better))
+      continue;
+    _mm256_storeu_pd(scores + k, _mm256_blendv_pd(old, score, better));
+    __m128i mask = _mm256_castsi256_si128(
+        _mm256_permutevar8x32_epi32(_mm256_castpd_si256(better), halves));
+    __m128i old_prevs = _mm_loadu_si128((const __m128i *)(prevs + k));
+    _mm_storeu_si128((__m128i *)(prevs + k),
+                     _mm_blendv_epi8(old_prevs, prev4, mask));
+  }
+  relax_scalar(base, edges + k, n - k, scores + k, prevs + k, prev);
+}
+
+__attribute__((target("avx512f,avx512vl"))) static void
+relax_avx512(double base, const float *edges, size_t n, double *scores,
+             u32 *prevs, u32 prev) {
+  const __m512d base8 = _mm512_set1_pd(base);
+  const __m256i prev8 = _mm256_set1_epi32(prev);
+  for (size_t k = 0; k < n; k += 8) {
+    __mmask8 lanes = n - k >= 8 ? 0xff : (1 << (n - k)) - 1;
+    __m256 edges8 = _mm256_maskz_loadu_ps(lanes, edges + k);
+    __m512d score =
+        _mm512_add_pd(base8, _mm512_maskz_cvtps_pd(lanes, edges8));
+    __m512d old = _mm512_maskz_loadu_pd(lanes, scores + k);
+    __mmask8 better = _mm512_mask_cmp_pd_mask(lanes, score, old, _CMP_GT_OQ);
+    _mm512_mask_storeu_pd(scores + k, better, score);
+    _mm256_mask_storeu_epi32(prevs + k, better, prev8);
+  }
+}
+
+#endif
+
+typedef void (*RelaxKernel)(double, const float *, size_t, double *, u32 *,
+                            u32);
+
+static RelaxKernel select_kernel() {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+    return relax_avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return relax_avx2;
+#endif
+  return relax_scalar;
+}
+
+void relax_slots(double base, const float *edges, size_t n, double *scores,
+                 u32 *prevs, u32 prev) {
+  static const RelaxKernel kernel = select_kernel();
+  kernel(base, edges, n, scores, prevs, prev);
+}
@@ -1,16 +1,111 @@
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <fstream>
 
 #include "encoding.hpp"
 #include "tables.hpp"
 #include "utils.hpp"
 
+/// Finalizer of MurmurHash3.
+static u64 mix(u64 key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+/// Slot of a packed key in a perfect hash table of `mask + 1` slots.
+static size_t hash_slot(u64 key, u32 displacement, size_t mask) {
+  return mix(key + (u64)displacement * 0x9e3779b97f4a7c15ULL) & mask;
+}
+
+u64 SyllableTable::pack(Span<char> key) {
+  if (key.empty() || key.size() > 12)
+    return 0;
+  u64 packed = 0;
+  for (char c : key) {
+    if (c < 'a' || c > 'z')
+      return 0;
+    packed = packed << 5 | (c - 'a' + 1);
+  }
+  return packed;
+}
+
+void SyllableTable::build() {
+  std::vector<std::pair<u64, Syllable>> keys;
+  for (Syllable s = 0; s < spellings.size(); s++) {
+    auto &spelling = spellings[s];
+    if (u64 packed = pack(Span<char>(spelling.data(), spelling.size())))
+      keys.push_back({packed, s});
+  }
+
+  // About 4 keys per bucket and a load factor of at most 1/2
+  size_t bucket_count = 1, slot_count = 2;
+  while (bucket_count * 4 < keys.size())
+    bucket_count *= 2;
+  while (slot_count < keys.size() * 2)
+    slot_count *= 2;
+  std::vector<std::vector<size_t>> buckets(bucket_count);
+  for (size_t i = 0; i < keys.size(); i++) {
+    buckets[mix(keys[i].first) & (bucket_count - 1)].push_back(i);
+  }
+  std::vector<size_t> order(bucket_count);
+  for (size_t b = 0; b < bucket_count; b++) {
+    order[b] = b;
+  }
+  // Place the largest buckets first, while most slots are free
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  displacements.assign(bucket_count, 0);
+  slot_keys.assign(slot_count, 0);
+  slot_values.assign(slot_count, INVALID_SYLLABLE);
+  std::vector<size_t> slots;
+  for (auto b : order) {
+    for (u32 d = 0;; d++) {
+      assert(d != UINT32_MAX && "No perfect hash found");
+      slots.clear();
+      for (auto i : buckets[b]) {
+        size_t slot = hash_slot(keys[i].first, d, slot_count - 1);
+        if (slot_keys[slot] ||
+            std::find(slots.begin(), slots.end(), slot) != slots.end())
+          break;
+        slots.push_back(slot);
+      }
+      if (slots.size() < buckets[b].size())
+        continue;
+      displacements[b] = d;
+      for (size_t k = 0; k < slots.size(); k++) {
+        slot_keys[slots[k]] = keys[buckets[b][k]].first;
+        slot_values[slots[k]] = keys[buckets[b][k]].second;
+      }
+      break;
+    }
+  }
+  built = true;
+}
+
 Syllable SyllableTable::insert(const std::string &key) {
   assert(!table.count(key) && "Duplicate syllable");
+  Syllable syllable = spellings.size();
   spellings.push_back(key);
-  return table[key] = table.size();
+  table[key] = syllable;
+  built = false;
+  return syllable;
 }
-Syllable SyllableTable::get(const std::string &key) const {
-  auto it = table.find(key);
+Syllable SyllableTable::get(Span<char> key) const {
+  assert(built && "Call build() before looking up syllables");
+  if (u64 packed = pack(key)) {
+    size_t mask = slot_keys.size() - 1;
+    u32 displacement = displacements[mix(packed) & (displacements.size() - 1)];
+    size_t slot = hash_slot(packed, displacement, mask);
+    return slot_keys[slot] == packed ? slot_values[slot] : INVALID_SYLLABLE;
+  }
+  auto it = table.find(std::string(key.begin(), key.end()));
   if (it != table.end()) {
     return it->second;
   }
@@ -19,16 +114,34 @@ Syllable SyllableTable::get(const std::string &key) const {
 
 std::vector<Syllable> SyllableTable::split(const std::string &seq) const {
   std::vector<Syllable> result;
-  split_for_each(seq, [&](const std::string &syllable) {
-    auto index = get(syllable);
-    if (index == INVALID_SYLLABLE) {
-      throw std::runtime_error("Invalid syllable: " + syllable);
-    }
-    result.push_back(index);
-  });
+  Span<char> error;
+  if (split(Span<char>(seq.data(), seq.size()), result, &error) !=
+      SplitStatus::OK) {
+    throw std::runtime_error("Invalid syllable: " +
+                             std::string(error.begin(), error.end()));
+  }
   return result;
 }
 
+SplitStatus SyllableTable::split(Span<char> seq, std::vector<Syllable> &out,
+                                 Span<char> *error) const {
+  const char *p = seq.begin(), *end = seq.end();
+  while (true) {
+    auto space = p < end ? (const char *)memchr(p, ' ', end - p) : nullptr;
+    Span<char> token(p, (space ? space : end) - p);
+    Syllable syllable = get(token);
+    if (syllable == INVALID_SYLLABLE) {
+      if (error)
+        *error = token;
+      return SplitStatus::UNKNOWN_SYLLABLE;
+    }
+    out.push_back(syllable);
+    if (!space)
+      return SplitStatus::OK;
+    p = space + 1;
+  }
+}
+
 Char gbk_as_char(const char *start) {
   u8 b1 = start[0] - 0x81;
   u8 b2 = start[1] - 0x40 - (start[1] >= 0x7f);
@@ -39,7 +152,15 @@ Char CharTable::insert(const char *start) {
   auto ch = gbk_as_char(start);
   if (!table[ch]) {
     table[ch] = allocated++;
-    utf8_chars.push_back(gbk_to_utf8(ic, start, 2));
+    utf8_chars.push_back(gbk_to_utf8(start, 2));
+
+    const char *p = utf8_chars.back().data();
+    u32 codepoint = next_utf8(p, p + utf8_chars.back().size());
+    assert(codepoint < 0x10000 && "Not a GBK character");
+    auto &page = pages[codepoint >> 8];
+    if (!page)
+      page.reset(new Char[0x100]());
+    page[codepoint & 0xff] = table[ch];
   }
   return table[ch];
 }
@@ -48,62 +169,196 @@ Char CharTable::get(const char *start) const {
   return result ? result : INVALID_CHAR;
 }
 
-std::vector<Char> CharTable::chars(Syllable syllable) const {
+void CharTable::insert(Syllable syllable, Char ch) {
+  auto &entry = sy_chars[syllable];
+  auto it = std::upper_bound(entry.sorted.begin(), entry.sorted.end(), ch);
+  entry.ranks.insert(entry.ranks.begin() + (it - entry.sorted.begin()),
+                     entry.chars.size());
+  entry.sorted.insert(it, ch);
+  entry.chars.push_back(ch);
+}
+
+const CharTable::SyllableChars &CharTable::find_chars(Syllable syllable) const {
+  static const SyllableChars EMPTY;
   auto it = sy_chars.find(syllable);
   if (it != sy_chars.end()) {
     return it->second;
   }
-  return {};
+  return EMPTY;
 }
 
-Word WordTable::insert(const std::string &key, std::vector<Syllable> pinyin) {
-  assert(!table.count(key) && "Duplicate word");
-  words.push_back(key);
-  pinyins.push_back(std::move(pinyin));
-  return table[key] = table.size() + 2;
+/// FNV-1a hash of a word.
+static u64 hash_word(Span<char> key) {
+  u64 hash = 0xcbf29ce484222325ULL;
+  for (char c : key) {
+    hash = (hash ^ (u8)c) * 0x100000001b3ULL;
+  }
+  return hash;
 }
-Word WordTable::get(const std::string &key) const {
-  auto it = table.find(key);
-  if (it != table.end()) {
-    return it->second;
+
+WordTable::WordTable()
+    : word_offsets({0}), pinyin_offsets({0}), slots(16, INVALID_WORD) {
+  append(Span<char>("<s>", 3), {});
+  append(Span<char>("</s>", 4), {});
+}
+
+Word WordTable::append(Span<char> key, Span<Syllable> pinyin) {
+  assert(arena.size() + key.size() <= UINT32_MAX && "Word arena overflow");
+  arena.append(key.data(), key.size());
+  word_offsets.push_back(arena.size());
+  syllables.insert(syllables.end(), pinyin.begin(), pinyin.end());
+  pinyin_offsets.push_back(syllables.size());
+  return size() - 1;
+}
+
+size_t WordTable::find_slot(Span<char> key, u64 hash) const {
+  size_t mask = slots.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    Word w = slots[i];
+    if (w == INVALID_WORD)
+      return i;
+    auto candidate = word(w);
+    if (candidate.size() == key.size() &&
+        !memcmp(candidate.data(), key.data(), key.size()))
+      return i;
   }
-  return INVALID_WORD;
 }
 
-static std::string UNK = "<unk>";
+void WordTable::grow_index() {
+  std::vector<Word> old_slots(slots.size() * 2, INVALID_WORD);
+  old_slots.swap(slots);
+  for (auto w : old_slots) {
+    if (w != INVALID_WORD)
+      slots[find_slot(word(w), hash_word(word(w)))] = w;
+  }
+}
 
-const std::string &WordTable::word(Word word) const {
-  return word == INVALID_WORD ? UNK : words[word];
+Word WordTable::insert(Span<char> key, Span<Syllable> pinyin) {
+  if ((indexed + 1) * 2 > slots.size())
+    grow_index();
+  size_t slot = find_slot(key, hash_word(key));
+  assert(slots[slot] == INVALID_WORD && "Duplicate word");
+  indexed++;
+  return slots[slot] = append(key, pinyin);
+}
+Word WordTable::get(Span<char> key) const {
+  return slots[find_slot(key, hash_word(key))];
+}
+
+Span<char> WordTable::word(Word word) const {
+  if (word == INVALID_WORD)
+    return Span<char>("<unk>", 5);
+  return Span<char>(arena.data() + word_offsets[word],
+                    word_offsets[word + 1] - word_offsets[word]);
 }
 
 std::vector<Syllable> WordTable::infer_pinyin(Word word) const {
   std::vector<Syllable> pinyin;
-  auto &word_utf8 = this->word(word);
-  for (size_t i = 0; i < word_utf8.size();) {
-    char c = word_utf8[i];
-    std::string ch;
-    if ((c & 0x80) == 0) {
-      ch = c;
-      i++;
-    } else if ((c & 0xE0) == 0xC0) {
-      ch = word_utf8.substr(i, 2);
-      i += 2;
-    } else if ((c & 0xF0) == 0xE0) {
-      ch = word_utf8.substr(i, 3);
-      i += 3;
-    } else if ((c & 0xF8) == 0xF0) {
-      ch = word_utf8.substr(i, 4);
-      i += 4;
-    } else
+  auto word_utf8 = this->word(word);
+  const char *p = word_utf8.begin(), *end = word_utf8.end();
+  while (p < end) {
+    const char *start = p;
+    if (next_utf8(p, end) == INVALID_CODEPOINT)
       throw std::runtime_error("utf8_length: invalid UTF-8");
 
-    auto ch_word = get(ch);
+    auto ch_word = get(Span<char>(start, p - start));
     if (ch_word == INVALID_WORD)
       return {};
-    auto py = pinyins[ch_word];
+    auto py = this->pinyin(ch_word);
     if (py.empty())
       return {};
     pinyin.push_back(py[0]);
   }
   return pinyin;
 }
+
+void WordTable::save(const char *path) const {
+  std::vector<Syllable> resolved_syllables;
+  std::vector<u32> resolved_offsets = {0};
+  for (Word w = 0; w < size(); w++) {
+    auto py = pinyin(w);
+    if (py.empty() && w != sos() && w != eos()) {
+      auto inferred = infer_pinyin(w);
+      resolved_syllables.insert(resolved_syllables.end(), inferred.begin(),
+                                inferred.end());
+    } else {
+      resolved_syllables.insert(resolved_syllables.end(), py.begin(),
+                                py.end());
+    }
+    resolved_offsets.push_back(resolved_syllables.size());
+  }
+
+  WordTableHeader h = {};
+  memcpy(h.magic, WORD_TABLE_MAGIC, sizeof(h.magic));
+  h.version = WORD_TABLE_VERSION;
+  h.word_count = size();
+  h.arena_size = arena.size();
+  h.syllable_count = resolved_syllables.size();
+  h.slot_count = slots.size();
+  h.indexed = indexed;
+
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    throw std::runtime_error(std::string("Failed to open file: ") + path);
+  }
+  auto write = [&](const void *data, size_t size) {
+    static const char padding[8] = {};
+    out.write((const char *)data, size);
+    out.write(padding, align8(size) - size);
+  };
+  write(&h, sizeof(h));
+  write(word_offsets.data(), word_offsets.size() * sizeof(u32));
+  write(arena.data(), arena.size());
+  write(resolved_offsets.data(), resolved_offsets.size() * sizeof(u32));
+  write(resolved_syllables.data(),
+        resolved_syllables.size() * sizeof(Syllable));
+  write(slots.data(), slots.size() * sizeof(Word));
+}
+
+void WordTable::load(const char *path) {
+  MappedFile file(path);
+  const u8 *p = file.data();
+  if (file.size() < sizeof(WordTableHeader)) {
+    throw std::runtime_error("Word table image is truncated");
+  }
+  WordTableHeader h;
+  memcpy(&h, p, sizeof(h));
+  if (memcmp(h.magic, WORD_TABLE_MAGIC, sizeof(h.magic)) ||
+      h.version != WORD_TABLE_VERSION || h.word_count < 2 ||
+      !h.slot_count || (h.slot_count & (h.slot_count - 1)) ||
+      h.indexed * 2 > h.slot_count) {
+    throw std::runtime_error("Unsupported word table image");
+  }
+  size_t total = align8(sizeof(h)) +
+                 align8((h.word_count + 1) * sizeof(u32)) * 2 +
+                 align8(h.arena_size) +
+                 align8(h.syllable_count * sizeof(Syllable)) +
+                 align8(h.slot_count * sizeof(Word));
+  if (total != file.size()) {
+    throw std::runtime_error("Word table image size mismatch");
+  }
+
+  p += align8(sizeof(h));
+  auto read = [&](void *data, size_t size) {
+    memcpy(data, p, size);
+    p += align8(size);
+  };
+  word_offsets.resize(h.word_count + 1);
+  read(word_offsets.data(), word_offsets.size() * sizeof(u32));
+  arena.resize(h.arena_size);
+  read(&arena[0], arena.size());
+  pinyin_offsets.resize(h.word_count + 1);
+  read(pinyin_offsets.data(), pinyin_offsets.size() * sizeof(u32));
+  syllables.resize(h.syllable_count);
+  read(syllables.data(), syllables.size() * sizeof(Syllable));
+  slots.resize(h.slot_count);
+  read(slots.data(), slots.size() * sizeof(Word));
+  assert(p == file.data() + file.size() && "Word table image overrun");
+
+  if (word_offsets.back() != arena.size() ||
+      pinyin_offsets.back() != syllables.size()) {
+    throw std::runtime_error("Invalid word table image");
+  }
+  indexed = h.indexed;
+  resolved = true;
+}
@@ -1,7 +1,9 @@
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <set>
+#include <vector>
 
 #include "aho_corasick.hpp"
 
@@ -12,9 +14,8 @@ template <class V> void assert_eq(const V &a, const V &b) {
 template <class K, class V>
 std::set<V> all_values(const AhoCorasick<K, V> &ac, const K &key) {
   std::set<V> result;
-  ac.for_all_values(ac.get_node(key), [&](const std::unique_ptr<V> &value) {
-    result.insert(*value);
-  });
+  ac.for_all_values(ac.get_node(key),
+                    [&](const V &value) { result.insert(value); });
   return result;
 }
 
@@ -45,7 +46,64 @@ void test2() {
   std::cerr << "test2 passed\n";
 }
 
+void test3() {
+  // The frozen goto function must agree with walking the tree
+  AhoCorasick<std::vector<u16>, u32> ac;
+  u32 seed = 12345;
+  auto rand = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+  };
+  for (u32 i = 0; i < 2000; i++) {
+    std::vector<u16> key(rand() % 6 + 1);
+    for (auto &e : key) {
+      e = rand() % 40;
+    }
+    ac.add(key, i);
+  }
+  ac.build();
+
+  for (u32 node = 0; node < ac.size(); node++) {
+    for (u16 e = 0; e < 64; e++) {
+      assert_eq(ac.transit(node, e), ac.transit_tree(node, e));
+    }
+  }
+
+  std::cerr << "test3 passed\n";
+}
+
+void test4() {
+  // Freezing a dictionary-sized trie must stay compact: the array holds a few
+  // slots per node. The time is only reported (the quadratic placement did
+  // not finish in ten minutes)
+  AhoCorasick<std::vector<u16>, u32> ac;
+  u32 seed = 54321;
+  auto rand = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+  };
+  for (u32 i = 0; i < 100000; i++) {
+    std::vector<u16> key(rand() % 5 + 2);
+    for (auto &e : key) {
+      // Skewed towards small syllables, like real pinyin
+      e = (rand() % 406) * (rand() % 406) / 406;
+    }
+    ac.add(key, i);
+  }
+  auto start = std::chrono::steady_clock::now();
+  ac.build();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  assert(ac.table_size() <= 2 * ac.size() && "double array too sparse");
+
+  std::cerr << "test4 passed (" << ac.size() << " nodes, " << ac.table_size()
+            << " slots, " << elapsed.count() << "s)\n";
+}
+
 int main() {
   test1();
   test2();
+  test3();
+  test4();
 }
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include <cassert>
+#include <iconv.h>
+#include <iostream>
+#include <string>
+
+#include "encoding.hpp"
+
+template <class V> void assert_eq(const V &a, const V &b) {
+  assert(a == b && "assert_eq failed");
+}
+
+/**
+ * Converts with iconv, stopping at the first invalid or unconvertible
+ * sequence like the functions under test.
+ */
+std::string iconv_convert(iconv_t ic, const std::string &in) {
+  std::string out(in.size() * 4 + 4, '\0');
+  char *inbuf = const_cast<char *>(in.data()), *outbuf = &out[0];
+  size_t inbytesleft = in.size(), outbytesleft = out.size();
+  iconv(ic, &inbuf, &inbytesleft, &outbuf, &outbytesleft);
+  iconv(ic, nullptr, nullptr, nullptr, nullptr);
+  out.resize(outbuf - out.data());
+  return out;
+}
+
+void test_gbk_to_utf8() {
+  // Every single byte and every lead and trail pair, valid or not
+  iconv_t ic = iconv_open("UTF-8", "GBK");
+  for (u32 lead = 0; lead < 0x100; lead++) {
+    std::string gbk(1, (char)lead);
+    assert_eq(gbk_to_utf8(gbk.data(), gbk.size()), iconv_convert(ic, gbk));
+    for (u32 trail = 0; trail < 0x100; trail++) {
+      gbk = {(char)lead, (char)trail};
+      assert_eq(gbk_to_utf8(gbk.data(), gbk.size()), iconv_convert(ic, gbk));
+    }
+  }
+  iconv_close(ic);
+
+  std::cerr << "test_gbk_to_utf8 passed\n";
+}
+
+void test_utf8_to_gbk() {
+  // Every code point of the BMP, where all of GBK lies
+  iconv_t ic = iconv_open("GBK", "UTF-8");
+  for (u32 codepoint = 0; codepoint < 0x10000; codepoint++) {
+    if (codepoint >= 0xd800 && codepoint < 0xe000)
+      continue;
+    std::string utf8;
+    append_utf8(utf8, codepoint);
+    assert_eq(utf8_to_gbk(utf8.data(), utf8.size()), iconv_convert(ic, utf8));
+  }
+  iconv_close(ic);
+
+  std::cerr << "test_utf8_to_gbk passed\n";
+}
+
+void test_mixed() {
+  // ASCII runs of every length around the 16-byte blocks, between Chinese
+  // characters, both ways
+  iconv_t to_utf8 = iconv_open("UTF-8", "GBK");
+  iconv_t to_gbk = iconv_open("GBK", "UTF-8");
+  u32 seed = 12345;
+  auto rand = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+  };
+  for (int i = 0; i < 2000; i++) {
+    std::string gbk;
+    while (gbk.size() < 100) {
+      gbk.append(rand() % 40, (char)('a' + rand() % 26));
+      gbk += (char)(0xb0 + rand() % 0x40);
+      gbk += (char)(0xa1 + rand() % 0x5e);
+    }
+    auto utf8 = gbk_to_utf8(gbk.data(), gbk.size());
+    assert_eq(utf8, iconv_convert(to_utf8, gbk));
+    assert_eq(utf8_to_gbk(utf8.data(), utf8.size()),
+              iconv_convert(to_gbk, utf8));
+  }
+  iconv_close(to_utf8);
+  iconv_close(to_gbk);
+
+  std::cerr << "test_mixed passed\n";
+}
+
+int main() {
+  test_gbk_to_utf8();
+  test_utf8_to_gbk();
+  test_mixed();
+}
@@ -0,0 +1,106 @@
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "trigram_spill.hpp"
+
+typedef std::map<std::tuple<Word, Word, Word>, u32> Counts;
+
+template <class V> void assert_eq(const V &a, const V &b) {
+  assert(a == b && "assert_eq failed");
+}
+
+/// Random trigrams over a small vocabulary, so that many of them repeat.
+std::vector<std::tuple<Word, Word, Word>> random_trigrams(size_t count,
+                                                          u32 words) {
+  u32 seed = 12345;
+  auto rand = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+  };
+  std::vector<std::tuple<Word, Word, Word>> trigrams;
+  for (size_t i = 0; i < count; i++) {
+    trigrams.emplace_back(rand() % words, rand() % words, rand() % words);
+  }
+  return trigrams;
+}
+
+/// Reads back all runs of a spill, checking that trigrams come in order.
+Counts merge_all(const TrigramSpill &spill) {
+  Counts counts;
+  TrigramMerger merger(spill.runs());
+  TrigramRecord record, last;
+  bool first = true;
+  while (merger.next(record)) {
+    assert((first || last < record) && "Trigrams out of order");
+    counts[std::make_tuple(record.word1, record.word2, record.word3)] =
+        record.count;
+    last = record;
+    first = false;
+  }
+  return counts;
+}
+
+void test_spill(size_t buffer_size) {
+  TrigramSpill spill("test_trigram_spill", buffer_size);
+  Counts expected;
+  for (auto &t : random_trigrams(3000, 6)) {
+    spill.add(std::get<0>(t), std::get<1>(t), std::get<2>(t));
+    expected[t]++;
+  }
+  spill.finish();
+  assert(spill.runs().size() > 1 && "Nothing was spilled");
+
+  assert_eq(merge_all(spill), expected);
+
+  std::cerr << "test_spill(" << buffer_size << ") passed\n";
+}
+
+void test_remap(size_t buffer_size) {
+  TrigramSpill spill("test_trigram_spill", buffer_size);
+  const u32 words = 6;
+  // Reverses the order of words, and merges the last two
+  std::vector<Word> word_map = {5, 4, 3, 2, 1, 1};
+  Counts expected;
+  for (auto &t : random_trigrams(3000, words)) {
+    spill.add(std::get<0>(t), std::get<1>(t), std::get<2>(t));
+    expected[std::make_tuple(word_map[std::get<0>(t)],
+                             word_map[std::get<1>(t)],
+                             word_map[std::get<2>(t)])]++;
+  }
+  spill.finish();
+  spill.remap(word_map);
+
+  assert_eq(merge_all(spill), expected);
+
+  std::cerr << "test_remap(" << buffer_size << ") passed\n";
+}
+
+void test_merge_runs(size_t buffer_size) {
+  for (size_t max_runs : {2, 3, 5}) {
+    TrigramSpill spill("test_trigram_spill", buffer_size);
+    Counts expected;
+    for (auto &t : random_trigrams(5000, 8)) {
+      spill.add(std::get<0>(t), std::get<1>(t), std::get<2>(t));
+      expected[t]++;
+    }
+    spill.finish();
+    assert(spill.runs().size() > max_runs && "Too few runs to merge");
+    spill.merge_runs(max_runs);
+    assert(spill.runs().size() <= max_runs && "Runs left unmerged");
+
+    assert_eq(merge_all(spill), expected);
+  }
+
+  std::cerr << "test_merge_runs(" << buffer_size << ") passed\n";
+}
+
+int main() {
+  for (size_t buffer_size : {8, 16}) {
+    test_spill(buffer_size);
+    test_remap(buffer_size);
+    test_merge_runs(buffer_size);
+  }
+}
@@ -0,0 +1,57 @@
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(size_t threads) : next_index(0) {
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  job_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t)> &f) {
+  std::lock_guard<std::mutex> submit_lock(submit_mutex);
+  std::unique_lock<std::mutex> lock(mutex);
+  job = &f;
+  job_size = n;
+  next_index = 0;
+  busy = workers.size();
+  generation++;
+  job_cv.notify_all();
+  done_cv.wait(lock, [&] { return busy == 0; });
+  job = nullptr;
+}
+
+void ThreadPool::work() {
+  u64 seen = 0;
+  while (true) {
+    const std::function<void(size_t)> *f;
+    size_t n;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      job_cv.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      f = job;
+      n = job_size;
+    }
+
+    size_t i;
+    while ((i = next_index++) < n) {
+      (*f)(i);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--busy == 0)
+      done_cv.notify_one();
+  }
+}
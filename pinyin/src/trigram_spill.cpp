@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+
+#include "trigram_spill.hpp"
+
+/**
+ * Sorts records and combines equal trigrams in place.
+ */
+static void sort_and_combine(std::vector<TrigramRecord> &records) {
+  std::sort(records.begin(), records.end());
+  size_t size = 0;
+  for (auto &record : records) {
+    if (size && records[size - 1].same_key(record)) {
+      records[size - 1].count += record.count;
+    } else {
+      records[size++] = record;
+    }
+  }
+  records.resize(size);
+}
+
+static void write_run(const std::string &path,
+                      const std::vector<TrigramRecord> &records) {
+  std::ofstream out(path, std::ios::binary);
+  out.write((const char *)records.data(),
+            records.size() * sizeof(TrigramRecord));
+  if (!out) {
+    throw std::runtime_error("Failed to write file: " + path);
+  }
+}
+
+TrigramSpill::TrigramSpill(std::string prefix, size_t buffer_size)
+    : prefix(std::move(prefix)),
+      buffer_size(std::max(buffer_size, (size_t)2)) {
+  buffer.reserve(this->buffer_size);
+}
+
+TrigramSpill::~TrigramSpill() {
+  for (auto &path : paths) {
+    std::remove(path.data());
+  }
+}
+
+void TrigramSpill::compact() {
+  sort_and_combine(buffer);
+  if (buffer.size() > buffer_size / 2)
+    spill();
+}
+
+std::string TrigramSpill::next_path() {
+  return prefix + '.' + std::to_string(run_count++);
+}
+
+void TrigramSpill::spill() {
+  paths.push_back(next_path());
+  write_run(paths.back(), buffer);
+  buffer.clear();
+}
+
+void TrigramSpill::finish() {
+  sort_and_combine(buffer);
+  if (!buffer.empty())
+    spill();
+  std::vector<TrigramRecord>().swap(buffer);
+}
+
+void TrigramSpill::remap(const std::vector<Word> &word_map) {
+  assert(buffer.empty() && "Call finish() before remap()");
+  std::vector<TrigramRecord> records;
+  for (auto &path : paths) {
+    {
+      std::ifstream in(path, std::ios::binary | std::ios::ate);
+      if (!in) {
+        throw std::runtime_error("Failed to open file: " + path);
+      }
+      records.resize(in.tellg() / sizeof(TrigramRecord));
+      in.seekg(0);
+      in.read((char *)records.data(), records.size() * sizeof(TrigramRecord));
+    }
+    for (auto &record : records) {
+      record.word1 = word_map[record.word1];
+      record.word2 = word_map[record.word2];
+      record.word3 = word_map[record.word3];
+    }
+    sort_and_combine(records);
+    write_run(path, records);
+  }
+}
+
+void TrigramSpill::merge_runs(size_t max_runs) {
+  assert(buffer.empty() && "Call finish() before merge_runs()");
+  max_runs = std::max(max_runs, (size_t)2);
+  while (paths.size() > max_runs) {
+    size_t fan_in = std::min(paths.size() - max_runs + 1, max_runs);
+    std::vector<std::string> group(paths.begin(), paths.begin() + fan_in);
+    auto path = next_path();
+    {
+      TrigramMerger merger(group);
+      std::ofstream out(path, std::ios::binary);
+      TrigramRecord record;
+      while (merger.next(record)) {
+        out.write((const char *)&record, sizeof(record));
+      }
+      if (!out) {
+        throw std::runtime_error("Failed to write file: " + path);
+      }
+    }
+    for (auto &run : group) {
+      std::remove(run.data());
+    }
+    paths.erase(paths.begin(), paths.begin() + fan_in);
+    paths.push_back(path);
+  }
+}
+
+/// A run being merged, read one block at a time.
+struct TrigramMerger::Run {
+  static const size_t BLOCK_SIZE = 4096;
+
+  explicit Run(const std::string &path) : in(path, std::ios::binary) {
+    if (!in) {
+      throw std::runtime_error("Failed to open file: " + path);
+    }
+    refill();
+  }
+
+  bool empty() const { return pos == block.size(); }
+  const TrigramRecord &current() const { return block[pos]; }
+  void advance() {
+    if (++pos == block.size())
+      refill();
+  }
+
+  void refill() {
+    block.resize(BLOCK_SIZE);
+    in.read((char *)block.data(), BLOCK_SIZE * sizeof(TrigramRecord));
+    block.resize(in.gcount() / sizeof(TrigramRecord));
+    pos = 0;
+  }
+
+  std::ifstream in;
+  std::vector<TrigramRecord> block;
+  size_t pos = 0;
+};
+
+TrigramMerger::TrigramMerger(const std::vector<std::string> &paths) {
+  for (auto &path : paths) {
+    runs.emplace_back(new Run(path));
+    if (!runs.back()->empty())
+      heap.push_back(runs.size() - 1);
+  }
+  std::make_heap(heap.begin(), heap.end(), [&](size_t a, size_t b) {
+    return runs[b]->current() < runs[a]->current();
+  });
+}
+
+TrigramMerger::~TrigramMerger() = default;
+
+bool TrigramMerger::pop(TrigramRecord &record) {
+  if (heap.empty())
+    return false;
+  auto greater = [&](size_t a, size_t b) {
+    return runs[b]->current() < runs[a]->current();
+  };
+  std::pop_heap(heap.begin(), heap.end(), greater);
+  auto &run = *runs[heap.back()];
+  record = run.current();
+  run.advance();
+  if (run.empty()) {
+    heap.pop_back();
+  } else {
+    std::push_heap(heap.begin(), heap.end(), greater);
+  }
+  return true;
+}
+
+bool TrigramMerger::next(TrigramRecord &record) {
+  if (!has_pending && !pop(pending))
+    return false;
+  record = pending;
+  has_pending = false;
+  TrigramRecord other;
+  while (pop(other)) {
+    if (!other.same_key(record)) {
+      pending = other;
+      has_pending = true;
+      break;
+    }
+    record.count += other.count;
+  }
+  return true;
+}
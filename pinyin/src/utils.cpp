@@ -1,4 +1,8 @@
+#include <fcntl.h>
 #include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "utils.hpp"
 
@@ -16,6 +20,20 @@ u64 read_uleb(std::istream &in) {
   return value;
 }
 
+u64 read_uleb(const u8 *&ptr) {
+  u64 value = 0;
+  u8 shift = 0;
+  while (true) {
+    u8 byte = *ptr++;
+    value |= (u64)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+    shift += 7;
+  }
+  return value;
+}
+
 void write_uleb(std::ostream &out, u64 value) {
   while (value >= 0x80) {
     char byte = (char)((value & 0x7f) | 0x80);
@@ -26,6 +44,38 @@ void write_uleb(std::ostream &out, u64 value) {
   out.write(&byte, 1);
 }
 
+MappedFile::MappedFile(const char *filename) : ptr(nullptr), len(0) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(std::string("Failed to open file: ") + filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw std::runtime_error(std::string("Failed to stat file: ") + filename);
+  }
+  len = st.st_size;
+  if (len) {
+    void *addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error(std::string("Failed to map file: ") + filename);
+    }
+    ptr = (const u8 *)addr;
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (ptr)
+    munmap(const_cast<u8 *>(ptr), len);
+}
+
+void MappedFile::advise_sequential() const {
+  if (ptr)
+    madvise(const_cast<u8 *>(ptr), len, MADV_SEQUENTIAL);
+}
+
 std::unordered_set<std::string> load_punctuations() {
   std::unordered_set<std::string> result;
   std::ifstream file("extra/punctuations.txt");
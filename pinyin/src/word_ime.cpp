@@ -8,53 +8,33 @@
 
 #include "ime/word.hpp"
 
+#include "lattice.hpp"
 #include "utils.hpp"
 
 WordIME::WordIME(std::shared_ptr<WordTable> wt, const char *dict_path,
                  WordIMEOptions options)
     : options(std::move(options)), word_table(std::move(wt)) {
-  unigram_freqs.resize(word_table->size());
-  bigram_freqs.resize(word_table->size());
-  total = 0;
-
-  std::ifstream dict_file(dict_path);
-  for (Word i = 0; i < word_table->size(); i++) {
-    unigram_freqs[i] = read_uleb(dict_file);
-    total += unigram_freqs[i];
-
-    u64 c1_size = read_uleb(dict_file);
-    Word cur = 0;
-    for (u64 j = 0; j < c1_size; j++) {
-      cur += read_uleb(dict_file);
-      bigram_freqs[i][cur] = 1;
-    }
-
-    u64 other_size = read_uleb(dict_file);
-    cur = 0;
-    for (u64 j = 0; j < other_size; j++) {
-      cur += read_uleb(dict_file);
-      bigram_freqs[i][cur] = read_uleb(dict_file);
-    }
-  }
-  assert(dict_file.peek() == EOF);
-  dict_file.close();
+  model.load(dict_path, word_table->size(), 2);
 
   for (Word word = 2; word < word_table->size(); word++) {
     auto pinyin = word_table->pinyin(word);
-    if (pinyin.empty())
-      pinyin = word_table->infer_pinyin(word);
-    if (pinyin.empty())
-      continue;
-
-    auto &ptr = pinyin_map.insert(pinyin);
-    if (!ptr) {
-      ptr = std::unique_ptr<PinyinMatches>(new PinyinMatches(pinyin.size()));
+    std::vector<Syllable> inferred;
+    if (pinyin.empty() && !word_table->pinyin_resolved()) {
+      inferred = word_table->infer_pinyin(word);
+      pinyin = inferred;
     }
-    ptr->words.push_back(word);
-    ptr->freq += unigram_freqs[word];
+    if (!pinyin.empty())
+      candidates.add(pinyin, word, model.unigram(word));
   }
+  candidates.build();
 
-  pinyin_map.build();
+  sy_freqs.assign(word_table->size(), 0);
+  for (size_t g = 0; g < candidates.groups(); g++) {
+    for (auto word : candidates.group(g)) {
+      sy_freqs[word] = candidates.group_freq(g);
+    }
+  }
+  sy_freqs[word_table->eos()] = model.unigram(word_table->eos());
 
 #ifdef KN_SMOOTHING
   memset(t, 0, sizeof(t));
@@ -63,15 +43,18 @@ WordIME::WordIME(std::shared_ptr<WordTable> wt, const char *dict_path,
   // u2 && t[1]
   u2.resize(word_table->size());
   for (Word word = 0; word < word_table->size(); word++) {
-    for (auto &pa : bigram_freqs[word]) {
-      assert(pa.second);
-      if (pa.second <= 4) {
-        t[1][pa.second - 1]++;
+    auto succs = model.successors(word);
+    u64 first = model.bigram_table().offsets[word];
+    for (size_t j = 0; j < succs.size(); j++) {
+      u32 count = model.bigram_count(first + j);
+      assert(count);
+      if (count <= 4) {
+        t[1][count - 1]++;
       }
-      u2[pa.first]++;
+      u2[succs[j]]++;
     }
   }
-  u2[word_table->sos()] = unigram_freqs[word_table->sos()];
+  u2[word_table->sos()] = model.unigram(word_table->sos());
 
   // t[0] & ud
   ud = 0;
@@ -112,127 +95,301 @@ WordIME::WordIME(std::shared_ptr<WordTable> wt, const char *dict_path,
     if (!u2[word])
       continue;
     u64 counts[3] = {0, 0, 0};
-    for (auto &pa : bigram_freqs[word]) {
-      if (pa.second <= 3) {
-        counts[pa.second - 1]++;
+    auto &bigrams = model.bigram_table();
+    for (u64 k = bigrams.offsets[word]; k < bigrams.offsets[word + 1]; k++) {
+      u32 count = model.bigram_count(k);
+      if (count <= 3) {
+        counts[count - 1]++;
       }
     }
     for (size_t i = 0; i < 3; i++) {
       b[word] += D[1][i] * counts[i];
     }
-    b[word] /= unigram_freqs[word];
+    b[word] /= model.unigram(word);
     double u = (u2[word] - D[0][std::min((u64)3, u2[word]) - 1]) / ud;
     p[word] = u + beps / size;
   }
 #endif
+
+  prepare();
 }
 
-std::string WordIME::translate(const std::vector<Syllable> &syllables) const {
-  struct PosState {
-    double prob;
-    Word prev;
-    u8 length;
+void WordIME::prepare() {
+  auto &bigrams = model.bigram_table();
+  std::vector<float> scores(bigrams.keys.size());
+
+#ifdef KN_SMOOTHING
+  std::vector<float> bs(word_table->size()), ps(word_table->size());
+  for (Word word = 0; word < word_table->size(); word++) {
+    bs[word] = std::log(b[word]);
+    ps[word] = std::log(p[word]);
+  }
+  log_b.assign(std::move(bs), model.count_bits());
+  log_p.assign(std::move(ps), model.count_bits());
+
+  for (Word word1 = 0; word1 < word_table->size(); word1++) {
+    for (u64 k = bigrams.offsets[word1]; k < bigrams.offsets[word1 + 1]; k++) {
+      u64 bi_freq = model.bigram_count(k);
+      double u = std::max(bi_freq - D[1][std::min((u64)3, bi_freq) - 1], 0.) /
+                 model.unigram(word1);
+      scores[k] = std::log(u + b[word1] * p[bigrams.keys[k]]);
+    }
+  }
+#else
+  const double lambda = options.lambda;
+  auto prob2 = [&](Word word) {
+    return sy_freqs[word] ? (double)model.unigram(word) / sy_freqs[word] : 0;
   };
-  std::vector<std::unordered_map<Word, PosState>> states(syllables.size() + 2);
-
-  size_t i = 0;
-  states[0][word_table->sos()] = {1.0, INVALID_WORD, 0};
-
-  auto transit = [&](const std::vector<Word> &words, u64 sy_freq, u8 length) {
-    if (i < length)
-      return;
-    for (auto &st_pa : states[i - length]) {
-      auto word1 = st_pa.first;
-      auto prev = st_pa.second;
-
-      auto &bi_freqs = bigram_freqs[word1];
-      for (auto word2 : words) {
-        u64 bi_freq = 0;
-        if (options.use_sos || word1 != word_table->sos()) {
-          auto it = bi_freqs.find(word2);
-          if (it != bi_freqs.end()) {
-            bi_freq = it->second;
-          }
-        }
 
+  std::vector<float> uni_scores(word_table->size());
+  for (Word word = 0; word < word_table->size(); word++) {
+    uni_scores[word] = std::log((1 - lambda) * prob2(word));
+  }
+  unigram_scores.assign(std::move(uni_scores), model.count_bits());
+  // Copies of the decoded scores, so they are quantized again exactly
+  std::vector<float> group_scores(candidates.group_begin(candidates.groups()));
+  for (size_t g = 0; g < candidates.groups(); g++) {
+    auto words = candidates.group(g);
+    for (size_t k = 0; k < words.size(); k++) {
+      group_scores[candidates.group_begin(g) + k] = unigram_scores[words[k]];
+    }
+  }
+  group_unigram_scores.assign(std::move(group_scores), model.count_bits());
+
+  for (Word word1 = 0; word1 < word_table->size(); word1++) {
+    for (u64 k = bigrams.offsets[word1]; k < bigrams.offsets[word1 + 1]; k++) {
+      double prob1 = (double)model.bigram_count(k) / model.unigram(word1);
+      scores[k] =
+          std::log(lambda * prob1 + (1 - lambda) * prob2(bigrams.keys[k]));
+    }
+  }
+#endif
+  bigram_scores.assign(std::move(scores), model.count_bits());
+  prepared_lambda = options.lambda;
+}
+
+void WordIME::start(Lattice<Word> &lattice) const {
+  assert(options.lambda == prepared_lambda &&
+         "Call prepare() after changing options");
+  lattice.add(word_table->sos(), 0.);
+  lattice.next_position();
+}
+
+float WordIME::edge_score(Word word1, Word word2, bool use_bigram) const {
+  u64 index = use_bigram ? model.bigram_index(word1, word2) : INVALID_INDEX;
 #ifdef KN_SMOOTHING
-        double u = std::max(bi_freq - D[1][std::min((u64)3, bi_freq) - 1], 0.) /
-                   unigram_freqs[word1];
-        double prob = u + b[word1] * p[word2];
+  return index == INVALID_INDEX ? log_b[word1] + log_p[word2]
+                                : bigram_scores[index];
 #else
-        double prob1 = (double)bi_freq / unigram_freqs[word1];
-        double prob2 = sy_freq ? (double)unigram_freqs[word2] / sy_freq : 0;
-        double prob = options.lambda * prob1 + (1 - options.lambda) * prob2;
+  if (!options.use_eos && word2 == word_table->eos())
+    return 0.;
+  return index == INVALID_INDEX ? unigram_scores[word2] : bigram_scores[index];
+#endif
+}
 
-        if (!options.use_eos && word2 == word_table->eos())
-          prob = 1.0;
+void WordIME::gather_edges(Word word1, size_t n, size_t group,
+                           float *edges) const {
+#ifdef KN_SMOOTHING
+  auto words = candidates.group(group);
+  for (size_t k = 0; k < n; k++) {
+    edges[k] = log_b[word1] + log_p[words[k]];
+  }
+#else
+  group_unigram_scores.decode(candidates.group_begin(group), n, edges);
 #endif
+  if (!options.use_sos && word1 == word_table->sos())
+    return;
 
-        if (options.debug) {
-          std::cerr << "> " << word_table->word(word1) << ' '
-                    << word_table->word(word2) << ' ' << prob << '\n';
-        }
+  // Merge the successors of `word1` with the group, both sorted by index
+  auto successors = model.successors(word1);
+  const Word *base = model.bigram_table().keys.data();
+  const Word *p = successors.begin(), *end = successors.end();
+  auto sorted = candidates.sorted_group(group);
+  auto ranks = candidates.sorted_ranks(group);
+  for (size_t i = 0; i < sorted.size() && p < end; i++) {
+    p = gallop(p, end, sorted[i]);
+    if (p < end && *p == sorted[i] && ranks[i] < n)
+      edges[ranks[i]] = bigram_scores[p - base];
+  }
+}
 
-        auto &state = states[i][word2];
-        if (update_max(state.prob, prev.prob * prob)) {
-          state.prev = word1;
-          state.length = length;
-        }
-      }
+void WordIME::transit(Lattice<Word> &lattice, Span<Word> words, u8 length,
+                      size_t group) const {
+  size_t i = lattice.positions();
+  if (i < length)
+    return;
+  u32 prev_begin = lattice.begin(i - length);
+  u32 prev_end = lattice.end(i - length);
+  u32 begin = lattice.size();
+  for (auto word : words) {
+    lattice.add(word);
+  }
+
+  if (group != CandidateIndex::NO_GROUP && lattice.hyp_width() == 1 &&
+      !options.debug) {
+    // Score all candidates of a predecessor, then relax them in one batch
+    static thread_local std::vector<float> edges;
+    edges.resize(words.size());
+    for (u32 s = prev_begin; s < prev_end; s++) {
+      if (lattice.scores[s] == -INFINITY)
+        continue;
+      gather_edges(lattice.keys[s], words.size(), group, edges.data());
+      lattice.offer_all(begin, edges.data(), words.size(), s);
     }
-  };
+    return;
+  }
 
-  u32 node = 0;
-  for (size_t j = 0; j < syllables.size(); j++) {
-    i++;
-    node = pinyin_map.transit(node, syllables[j]);
-    assert(node != INVALID_NODE);
-    pinyin_map.for_all_values(
-        node, [&](const std::unique_ptr<PinyinMatches> &matches) {
-          transit(matches->words, matches->freq, matches->length);
-        });
-
-    if (options.debug) {
-      std::vector<std::pair<Word, PosState>> new_states;
-      for (auto &st_pa : states[i]) {
-        new_states.push_back(st_pa);
+  for (u32 s = prev_begin; s < prev_end; s++) {
+    u32 first = lattice.hyp(s), last = lattice.hyp(s + 1);
+    if (lattice.scores[first] == -INFINITY)
+      continue;
+    auto word1 = lattice.keys[s];
+    bool use_bigram = options.use_sos || word1 != word_table->sos();
+
+    for (u32 k = 0; k < words.size(); k++) {
+      auto word2 = words[k];
+      double score = edge_score(word1, word2, use_bigram);
+
+      if (options.debug) {
+        std::cerr << "> " << word_table->word(word1) << ' '
+                  << word_table->word(word2) << ' ' << std::exp(score) << '\n';
       }
-      std::sort(new_states.begin(), new_states.end(),
-                [](const std::pair<Word, PosState> &a,
-                   const std::pair<Word, PosState> &b) {
-                  return a.second.prob > b.second.prob;
-                });
-      for (size_t j = 0; j < std::min((size_t)20, new_states.size()); j++) {
-        std::cerr << word_table->word(new_states[j].second.prev) << ' '
-                  << word_table->word(new_states[j].first) << ": "
-                  << new_states[j].second.prob << '\n';
+
+      for (u32 h = first; h < last && lattice.scores[h] != -INFINITY; h++) {
+        lattice.offer(begin + k, lattice.scores[h] + score, h);
       }
-      std::cerr << '\n';
     }
   }
-  i++;
-  transit({word_table->eos()}, unigram_freqs[word_table->eos()], 1);
+}
+
+void WordIME::extend(Lattice<Word> &lattice, Span<Syllable> syllables) const {
+  size_t n = syllables.size();
+  // Longest pinyins first, the order in which an automaton would match them
+  for (size_t length = std::min(n, candidates.max_length()); length > 0;
+       length--) {
+    size_t group = candidates.find_group(syllables.sub(n - length, length));
+    if (group == CandidateIndex::NO_GROUP)
+      continue;
+    auto words = candidates.group(group);
+    if (options.max_candidates && words.size() > options.max_candidates)
+      words = words.sub(0, options.max_candidates);
+    transit(lattice, words, length, group);
+  }
+  lattice.next_position();
+  if (options.filter_threshold > 0 || options.max_states) {
+    lattice.prune(lattice.positions() - 1, std::log(options.filter_threshold),
+                  options.max_states);
+  }
+
+  if (options.debug) {
+    size_t i = lattice.positions() - 1;
+    std::vector<u32> slots;
+    for (u32 s = lattice.begin(i); s < lattice.end(i); s++) {
+      slots.push_back(s);
+    }
+    std::sort(slots.begin(), slots.end(), [&](u32 a, u32 b) {
+      return lattice.scores[lattice.hyp(a)] > lattice.scores[lattice.hyp(b)];
+    });
+    for (size_t j = 0; j < std::min((size_t)20, slots.size()); j++) {
+      auto prev = lattice.prevs[lattice.hyp(slots[j])];
+      std::cerr << word_table->word(prev == lattice.NO_SLOT
+                                        ? INVALID_WORD
+                                        : lattice.keys[lattice.slot_of(prev)])
+                << ' ' << word_table->word(lattice.keys[slots[j]]) << ": "
+                << std::exp(lattice.scores[lattice.hyp(slots[j])]) << '\n';
+    }
+    std::cerr << '\n';
+  }
+}
 
-  if (states[i].empty()) {
+bool WordIME::finish(Lattice<Word> &lattice) const {
+  Word eos = word_table->eos();
+  transit(lattice, Span<Word>(&eos, 1), 1);
+  lattice.next_position();
+  return lattice.scores[lattice.hyp(lattice.size() - 1)] != -INFINITY;
+}
+
+const Lattice<Word> &WordIME::decode(const std::vector<Syllable> &syllables,
+                                     u32 width) const {
+  assert(width > 0 && "At least one hypothesis must be kept");
+  auto &lattice = scratch_lattice<Word>(width);
+  start(lattice);
+  for (size_t j = 0; j < syllables.size(); j++) {
+    extend(lattice, Span<Syllable>(syllables.data(), j + 1));
+  }
+  if (!finish(lattice)) {
     throw std::runtime_error("No valid path found");
   }
+  return lattice;
+}
+
+std::string WordIME::spell(const Lattice<Word> &lattice, u32 hyp) const {
+  auto slots = lattice.path(hyp);
+  std::string result;
+  // Skip <s> and </s>
+  for (size_t i = 1; i + 1 < slots.size(); i++) {
+    auto word = word_table->word(lattice.keys[slots[i]]);
+    result.append(word.data(), word.size());
+  }
+  return result;
+}
 
-  Word word = word_table->eos();
-  std::vector<Word> result;
-  while (true) {
-    auto &state = states[i][word];
-    word = state.prev;
-    i -= state.length;
-    result.push_back(word);
-    if (i == 0) {
+std::string WordIME::translate(const std::vector<Syllable> &syllables) const {
+  auto &lattice = decode(syllables, 1);
+  return spell(lattice, lattice.hyp(lattice.size() - 1));
+}
+
+std::vector<Candidate>
+WordIME::translate_nbest(const std::vector<Syllable> &syllables,
+                         size_t k) const {
+  if (k == 0)
+    return {};
+  auto &lattice = decode(syllables, k);
+  std::vector<Candidate> candidates;
+  u32 last = lattice.size() - 1;
+  for (u32 r = 0; r < k; r++) {
+    u32 h = lattice.hyp(last, r);
+    if (lattice.scores[h] == -INFINITY)
       break;
-    }
+    push_candidate(candidates, spell(lattice, h), lattice.scores[h]);
+  }
+  return candidates;
+}
+
+class WordIME::Session : public DecodeSession {
+public:
+  explicit Session(const WordIME &ime) : ime(ime) { ime.start(lattice); }
+
+  void push(Syllable syllable) override {
+    syllables.push_back(syllable);
+    ime.extend(lattice, syllables);
+  }
+
+  void pop() override {
+    assert(size() > 0 && "No syllable to remove");
+    syllables.pop_back();
+    lattice.truncate(lattice.positions() - 1);
   }
-  result.pop_back();
 
-  std::string result_str;
-  for (auto it = result.rbegin(); it != result.rend(); it++) {
-    result_str += word_table->word(*it);
+  size_t size() const override { return syllables.size(); }
+
+  std::string text() override {
+    bool found = ime.finish(lattice);
+    auto result =
+        found ? ime.spell(lattice, lattice.hyp(lattice.size() - 1)) : "";
+    lattice.truncate(lattice.positions() - 1);
+    if (!found) {
+      throw std::runtime_error("No valid path found");
+    }
+    return result;
   }
-  return result_str;
-}
\ No newline at end of file
+
+private:
+  const WordIME &ime;
+  Lattice<Word> lattice;
+  std::vector<Syllable> syllables;
+};
+
+std::unique_ptr<DecodeSession> WordIME::start_session() const {
+  return std::unique_ptr<DecodeSession>(new Session(*this));
+}
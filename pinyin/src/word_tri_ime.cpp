@@ -1,7 +1,6 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
-#include <map>
 
 #include "ime/word_tri.hpp"
 
@@ -10,55 +9,13 @@
 WordTriIME::WordTriIME(std::shared_ptr<WordTable> wt, const char *dict_path,
                        WordTriIMEOptions options)
     : options(std::move(options)), word_table(std::move(wt)) {
-  unigram_freqs.resize(word_table->size());
-  bigram_freqs.resize(word_table->size());
-  trigram_freqs.resize(word_table->size());
-  total = 0;
-
-  std::ifstream dict_file(dict_path, std::ios::binary);
-  for (Word i = 0; i < word_table->size(); i++) {
-    unigram_freqs[i] = read_uleb(dict_file);
-    total += unigram_freqs[i];
-
-    u64 c1_size = read_uleb(dict_file);
-    Word last = 0;
-    for (u64 j = 0; j < c1_size; j++) {
-      last += read_uleb(dict_file);
-      Word w = read_uleb(dict_file);
-      bigram_freqs[i][last] = 1;
-      if (w != word_table->sos())
-        trigram_freqs[i][((u64)last << 32) | w] = 1;
-    }
-
-    u64 other_size = read_uleb(dict_file);
-    last = 0;
-    for (u64 j = 0; j < other_size; j++) {
-      last += read_uleb(dict_file);
-      auto &bi_freq = bigram_freqs[i][last];
-      bi_freq = read_uleb(dict_file);
-
-      u64 c1_tri_size = read_uleb(dict_file);
-      Word last2 = 0;
-      for (u64 k = 0; k < c1_tri_size; k++) {
-        last2 += read_uleb(dict_file);
-        bi_freq += trigram_freqs[i][((u64)last << 32) | last2] = 1;
-      }
-
-      u64 other_tri_size = read_uleb(dict_file);
-      last2 = 0;
-      for (u64 k = 0; k < other_tri_size; k++) {
-        last2 += read_uleb(dict_file);
-        bi_freq += trigram_freqs[i][((u64)last << 32) | last2] =
-            read_uleb(dict_file);
-      }
-    }
-  }
-  assert(dict_file.peek() == EOF);
-  dict_file.close();
+  model.load(dict_path, word_table->size(), 3);
 
+  std::vector<const PinyinMatches *> groups(word_table->size());
   for (Word word = 2; word < word_table->size(); word++) {
-    auto pinyin = word_table->pinyin(word);
-    if (pinyin.empty())
+    auto stored = word_table->pinyin(word);
+    std::vector<Syllable> pinyin(stored.begin(), stored.end());
+    if (pinyin.empty() && !word_table->pinyin_resolved())
       pinyin = word_table->infer_pinyin(word);
     if (pinyin.empty())
       continue;
@@ -68,160 +25,297 @@ WordTriIME::WordTriIME(std::shared_ptr<WordTable> wt, const char *dict_path,
       ptr = std::unique_ptr<PinyinMatches>(new PinyinMatches(pinyin.size()));
     }
     ptr->words.push_back(word);
-    ptr->freq += unigram_freqs[word];
+    ptr->freq += model.unigram(word);
+    groups[word] = ptr.get();
   }
 
   pinyin_map.build();
+
+  sy_freqs.resize(word_table->size());
+  for (Word word = 0; word < word_table->size(); word++) {
+    sy_freqs[word] = groups[word] ? groups[word]->freq : 0;
+  }
+  sy_freqs[word_table->eos()] = model.unigram(word_table->eos());
+
+  prepare();
 }
 
-std::string
-WordTriIME::translate(const std::vector<Syllable> &syllables) const {
-  struct PosState {
-    double prob;
-    Word prev;
-    u8 length;
-  };
-  std::vector<std::map<std::pair<Word, Word>, PosState>> states(
-      syllables.size() + 2);
-
-  size_t i = 0;
-  states[0][{INVALID_WORD, word_table->sos()}] = {1.0, INVALID_WORD, 0};
-  double layer_max_prob = 0.;
-
-  auto transit = [&](const std::vector<Word> &words, u64 sy_freq, u8 length) {
-    if (i < length)
-      return;
-    for (auto &st_pa : states[i - length]) {
-      auto word1 = st_pa.first.first;
-      auto word2 = st_pa.first.second;
-      auto prev = st_pa.second;
-
-      auto &bi_freqs = bigram_freqs[word2];
-      for (auto word3 : words) {
-        u64 bi_freq = 0, bi2_freq = 0, tri_freq = 0;
-
-        if (options.use_sos || word2 != word_table->sos()) {
-          auto it = bi_freqs.find(word3);
-          if (it != bi_freqs.end()) {
-            bi_freq = it->second;
-          }
-
-          if (word1 != INVALID_WORD &&
-              (options.use_sos || word1 != word_table->sos())) {
-            auto it2 = trigram_freqs[word1].find(((u64)word2 << 32) | word3);
-            if (it2 != trigram_freqs[word1].end()) {
-              tri_freq = it2->second;
-            }
-
-            auto it3 = bigram_freqs[word1].find(word2);
-            if (it3 != bigram_freqs[word1].end()) {
-              bi2_freq = it3->second;
-            }
-          }
-        }
+void WordTriIME::prepare() {
+  const double alpha = options.alpha, beta = options.beta;
+  auto &bigrams = model.bigram_table();
+  auto &trigrams = model.trigram_table();
+
+  std::vector<double> prob3(word_table->size());
+  std::vector<float> uni_scores(word_table->size());
+  for (Word word = 0; word < word_table->size(); word++) {
+    prob3[word] = (double)model.unigram(word) / sy_freqs[word];
+    uni_scores[word] = std::log((1 - beta) * (1 - alpha) * prob3[word]);
+  }
+  unigram_scores.assign(std::move(uni_scores), model.count_bits());
+
+  std::vector<float> bi_scores(bigrams.keys.size());
+  std::vector<float> tri_scores(trigrams.keys.size());
+  for (Word word1 = 0; word1 < word_table->size(); word1++) {
+    for (u64 k = bigrams.offsets[word1]; k < bigrams.offsets[word1 + 1]; k++) {
+      // As (word2, word3)
+      double prob2 = (double)model.bigram_count(k) / model.unigram(word1);
+      bi_scores[k] = std::log(
+          (1 - beta) * (alpha * prob2 + (1 - alpha) * prob3[bigrams.keys[k]]));
 
-        double prob1 = bi2_freq ? ((double)tri_freq / bi2_freq) : 0.;
-        double prob2 = (double)bi_freq / unigram_freqs[word2];
-        double prob3 = (double)unigram_freqs[word3] / sy_freq;
+      // As (word1, word2), followed by word3
+      Word word2 = bigrams.keys[k];
+      for (u64 t = trigrams.offsets[k]; t < trigrams.offsets[k + 1]; t++) {
+        Word word3 = trigrams.keys[t];
+        double prob1 =
+            (double)model.trigram_count(t) / model.bigram_count(k);
+        double prob2 =
+            (double)model.bigram(word2, word3) / model.unigram(word2);
+        tri_scores[t] = std::log(
+            beta * prob1 +
+            (1 - beta) * (alpha * prob2 + (1 - alpha) * prob3[word3]));
+      }
+    }
+  }
+  bigram_scores.assign(std::move(bi_scores), model.count_bits());
+  trigram_scores.assign(std::move(tri_scores), model.count_bits());
+  prepared_alpha = alpha;
+  prepared_beta = beta;
+}
 
-        double prob = options.beta * prob1 +
-                      (1 - options.beta) *
-                          (options.alpha * prob2 + (1 - options.alpha) * prob3);
+void WordTriIME::start(StateLattice &sl) const {
+  assert(options.alpha == prepared_alpha && options.beta == prepared_beta &&
+         "Call prepare() after changing options");
+  sl.lattice.add(pack(INVALID_WORD, word_table->sos()), 0.);
+  sl.lattice.next_position();
+}
 
-        if (!options.use_eos && word3 == word_table->eos())
-          prob = 1.0;
+void WordTriIME::transit(StateLattice &sl, const std::vector<Word> &words,
+                         u8 length, double &layer_max_score) const {
+  auto &lattice = sl.lattice;
+  size_t i = lattice.positions();
+  if (i < length)
+    return;
+  const Word sos = word_table->sos();
+  const double log_threshold = std::log(options.filter_threshold);
+  for (u32 s = lattice.begin(i - length); s < lattice.end(i - length); s++) {
+    u32 first = lattice.hyp(s), last = lattice.hyp(s + 1);
+    // Filtered out
+    if (lattice.scores[first] == -INFINITY)
+      continue;
+    auto word1 = word1_of(lattice.keys[s]);
+    auto word2 = word2_of(lattice.keys[s]);
+    bool use_bigram = options.use_sos || word2 != sos;
 
-        if (options.debug) {
-          std::cerr << "> " << word_table->word(word1) << ' '
-                    << word_table->word(word2) << ' ' << word_table->word(word3)
-                    << ' ' << prob << '\n';
-        }
+    // Bigram entry (word1, word2), shared by all candidates
+    u64 bi2_index = INVALID_INDEX;
+    if (use_bigram && word1 != INVALID_WORD &&
+        (options.use_sos || word1 != sos)) {
+      bi2_index = model.bigram_index(word1, word2);
+    }
 
-        auto &state = states[i][{word2, word3}];
-        if (update_max(state.prob, prev.prob * prob)) {
-          state.prev = word1;
-          state.length = length;
-          update_max(layer_max_prob, state.prob);
+    for (auto word3 : words) {
+      double score = unigram_scores[word3];
+      if (use_bigram) {
+        u64 index = INVALID_INDEX;
+        if (bi2_index != INVALID_INDEX)
+          index = model.trigram_index(bi2_index, word3);
+        if (index != INVALID_INDEX) {
+          score = trigram_scores[index];
+        } else {
+          index = model.bigram_index(word2, word3);
+          if (index != INVALID_INDEX)
+            score = bigram_scores[index];
         }
       }
-    }
-  };
 
-  u32 node = 0;
-  for (size_t j = 0; j < syllables.size(); j++) {
-    layer_max_prob = 0.;
-    i++;
-    node = pinyin_map.transit(node, syllables[j]);
-    assert(node != INVALID_NODE);
-    pinyin_map.for_all_values(
-        node, [&](const std::unique_ptr<PinyinMatches> &matches) {
-          transit(matches->words, matches->freq, matches->length);
-        });
-
-    // Filter out low-probability states
-    double threshold = layer_max_prob * options.filter_threshold;
-    for (auto it = states[i].begin(); it != states[i].end();) {
-      if (it->second.prob < threshold) {
-        it = states[i].erase(it);
-      } else {
-        ++it;
+      if (!options.use_eos && word3 == word_table->eos())
+        score = 0.;
+
+      if (options.debug) {
+        std::cerr << "> " << word_table->word(word1) << ' '
+                  << word_table->word(word2) << ' ' << word_table->word(word3)
+                  << ' ' << std::exp(score) << '\n';
       }
-    }
 
-    if (options.debug) {
-      std::vector<std::pair<std::pair<Word, Word>, PosState>> new_states;
-      for (auto &st_pa : states[i]) {
-        new_states.push_back(st_pa);
+      State state = pack(word2, word3);
+      u32 slot;
+      if (auto found = sl.slots.find(state)) {
+        slot = *found;
+      } else {
+        // Don't materialize a state that would be filtered out anyway. With
+        // several hypotheses per state, the skipped offer could still rank
+        // below the best one of the state once a later predecessor adds it,
+        // so the result would depend on the order of the predecessors
+        if (lattice.hyp_width() == 1 &&
+            lattice.scores[first] + score < layer_max_score + log_threshold)
+          continue;
+        slot = lattice.add(state);
+        sl.slots.insert(state, slot);
       }
-      std::sort(new_states.begin(), new_states.end(),
-                [](const std::pair<std::pair<Word, Word>, PosState> &a,
-                   const std::pair<std::pair<Word, Word>, PosState> &b) {
-                  return a.second.prob > b.second.prob;
-                });
-      for (size_t j = 0; j < std::min((size_t)20, new_states.size()); j++) {
-        std::cerr << word_table->word(new_states[j].second.prev) << ' '
-                  << word_table->word(new_states[j].first.first) << ' '
-                  << word_table->word(new_states[j].first.second) << ": "
-                  << new_states[j].second.prob << '\n';
+      for (u32 h = first; h < last && lattice.scores[h] != -INFINITY; h++) {
+        lattice.offer(slot, lattice.scores[h] + score, h);
       }
-      std::cerr << '\n';
+      update_max(layer_max_score, lattice.scores[lattice.hyp(slot)]);
     }
   }
-  i++;
-  transit({word_table->eos()}, unigram_freqs[word_table->eos()], 1);
+}
 
-  if (states[i].empty()) {
-    throw std::runtime_error("No valid path found");
+u32 WordTriIME::extend(StateLattice &sl, u32 node, Syllable syllable) const {
+  auto &lattice = sl.lattice;
+  sl.slots.clear();
+
+  double layer_max_score = -INFINITY;
+  node = pinyin_map.transit(node, syllable);
+  assert(node != INVALID_NODE);
+  for (auto matches : pinyin_map.values(node)) {
+    transit(sl, matches->words, matches->length, layer_max_score);
   }
+  lattice.next_position();
+
+  // Filter out low-probability states
+  size_t i = lattice.positions() - 1;
+  lattice.prune(i, std::log(options.filter_threshold), options.max_states);
 
-  Word word1 = INVALID_WORD, word2 = word_table->eos();
-  double max_prob = 0.;
-  for (auto &state : states[i]) {
-    if (state.second.prob > max_prob) {
-      word1 = state.first.first;
-      max_prob = state.second.prob;
+  if (options.debug) {
+    std::vector<u32> slots;
+    for (u32 s = lattice.begin(i); s < lattice.end(i); s++) {
+      if (lattice.scores[lattice.hyp(s)] != -INFINITY)
+        slots.push_back(s);
+    }
+    std::sort(slots.begin(), slots.end(), [&](u32 a, u32 b) {
+      return lattice.scores[lattice.hyp(a)] > lattice.scores[lattice.hyp(b)];
+    });
+    for (size_t j = 0; j < std::min((size_t)20, slots.size()); j++) {
+      auto prev = lattice.slot_of(lattice.prevs[lattice.hyp(slots[j])]);
+      auto state = lattice.keys[slots[j]];
+      std::cerr << word_table->word(word1_of(lattice.keys[prev])) << ' '
+                << word_table->word(word1_of(state)) << ' '
+                << word_table->word(word2_of(state)) << ": "
+                << std::exp(lattice.scores[lattice.hyp(slots[j])]) << '\n';
     }
+    std::cerr << '\n';
   }
-  if (word1 == INVALID_WORD) {
+  return node;
+}
+
+bool WordTriIME::finish(StateLattice &sl) const {
+  double layer_max_score = -INFINITY;
+  sl.slots.clear();
+  transit(sl, {word_table->eos()}, 1, layer_max_score);
+  sl.lattice.next_position();
+  return layer_max_score != -INFINITY;
+}
+
+const Lattice<WordTriIME::State> &
+WordTriIME::decode(const std::vector<Syllable> &syllables, u32 width) const {
+  assert(width > 0 && "At least one hypothesis must be kept");
+  static thread_local StateLattice sl;
+  sl.clear(width);
+  start(sl);
+  u32 node = 0;
+  for (size_t j = 0; j < syllables.size(); j++) {
+    node = extend(sl, node, syllables[j]);
+  }
+  if (!finish(sl)) {
     throw std::runtime_error("No valid path found");
   }
+  return sl.lattice;
+}
 
-  std::vector<Word> result = {word1};
-  while (true) {
-    auto &state = states[i][{word1, word2}];
-    word2 = word1;
-    word1 = state.prev;
-    i -= state.length;
-    if (i == 0) {
-      break;
+/**
+ * Gets the best `k` hypotheses ending with </s>, breaking ties by state.
+ */
+static std::vector<u32>
+final_hyps(const Lattice<u64> &lattice, size_t k) {
+  size_t last = lattice.positions() - 1;
+  std::vector<u32> hyps;
+  for (u32 s = lattice.begin(last); s < lattice.end(last); s++) {
+    for (u32 r = 0; r < lattice.hyp_width(); r++) {
+      if (lattice.scores[lattice.hyp(s, r)] == -INFINITY)
+        break;
+      hyps.push_back(lattice.hyp(s, r));
     }
-    result.push_back(word1);
   }
-  result.pop_back();
+  std::sort(hyps.begin(), hyps.end(), [&](u32 a, u32 b) {
+    if (lattice.scores[a] != lattice.scores[b])
+      return lattice.scores[a] > lattice.scores[b];
+    auto &key_a = lattice.keys[lattice.slot_of(a)];
+    auto &key_b = lattice.keys[lattice.slot_of(b)];
+    if (key_a != key_b)
+      return key_a < key_b;
+    return a < b;
+  });
+  if (hyps.size() > k)
+    hyps.resize(k);
+  return hyps;
+}
 
-  std::string result_str;
-  for (auto it = result.rbegin(); it != result.rend(); it++) {
-    result_str += word_table->word(*it);
+std::string WordTriIME::spell(const Lattice<State> &lattice, u32 hyp) const {
+  auto slots = lattice.path(hyp);
+  std::string result;
+  // Skip <s> and </s>
+  for (size_t i = 1; i + 1 < slots.size(); i++) {
+    auto word = word_table->word(word2_of(lattice.keys[slots[i]]));
+    result.append(word.data(), word.size());
   }
-  return result_str;
-}
\ No newline at end of file
+  return result;
+}
+
+std::string
+WordTriIME::translate(const std::vector<Syllable> &syllables) const {
+  auto &lattice = decode(syllables, 1);
+  return spell(lattice, final_hyps(lattice, 1)[0]);
+}
+
+std::vector<Candidate>
+WordTriIME::translate_nbest(const std::vector<Syllable> &syllables,
+                            size_t k) const {
+  if (k == 0)
+    return {};
+  auto &lattice = decode(syllables, k);
+  std::vector<Candidate> candidates;
+  for (auto h : final_hyps(lattice, k)) {
+    push_candidate(candidates, spell(lattice, h), lattice.scores[h]);
+  }
+  return candidates;
+}
+
+class WordTriIME::Session : public DecodeSession {
+public:
+  explicit Session(const WordTriIME &ime) : ime(ime), nodes(1, 0) {
+    ime.start(sl);
+  }
+
+  void push(Syllable syllable) override {
+    nodes.push_back(ime.extend(sl, nodes.back(), syllable));
+  }
+
+  void pop() override {
+    assert(size() > 0 && "No syllable to remove");
+    nodes.pop_back();
+    sl.lattice.truncate(sl.lattice.positions() - 1);
+  }
+
+  size_t size() const override { return nodes.size() - 1; }
+
+  std::string text() override {
+    bool found = ime.finish(sl);
+    auto result = found ? ime.spell(sl.lattice, final_hyps(sl.lattice, 1)[0])
+                        : std::string();
+    sl.lattice.truncate(sl.lattice.positions() - 1);
+    if (!found) {
+      throw std::runtime_error("No valid path found");
+    }
+    return result;
+  }
+
+private:
+  const WordTriIME &ime;
+  StateLattice sl;
+  /// Automaton node after each syllable.
+  std::vector<u32> nodes;
+};
+
+std::unique_ptr<DecodeSession> WordTriIME::start_session() const {
+  return std::unique_ptr<DecodeSession>(new Session(*this));
+}